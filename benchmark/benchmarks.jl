@@ -0,0 +1,151 @@
+# Measures the time per call for the different ways of calling between Julia and C++.
+# Usage: julia benchmarks.jl [output.json]
+# The results are written as a JSON object mapping each benchmark name to nanoseconds per call.
+
+using CxxWrap
+using Compat
+
+wrap_modules(CxxWrap._l_benchmark)
+
+benchmark_callback(x::Float64) = x + 1.
+
+const nb_calls = 10000000
+const const_string = "benchmark"
+const const_array = rand(1000)
+
+function loop_direct(n)
+  result = 0.
+  for i in 1:n
+    result = CxxWrapBenchmark.direct_add(result, 1.)
+  end
+  return result
+end
+
+function loop_thunk(n)
+  result = 0.
+  for i in 1:n
+    result = CxxWrapBenchmark.thunk_add(result, 1.)
+  end
+  return result
+end
+
+function loop_member(n)
+  c = CxxWrapBenchmark.Counter()
+  for i in 1:n
+    CxxWrapBenchmark.increment(c)
+  end
+  return CxxWrapBenchmark.count(c)
+end
+
+function loop_member_direct(n)
+  c = CxxWrapBenchmark.Counter()
+  for i in 1:n
+    CxxWrapBenchmark.increment_direct(c)
+  end
+  return CxxWrapBenchmark.count(c)
+end
+
+# Includes running the finalizers of the created objects
+function loop_create(n)
+  for i in 1:n
+    CxxWrapBenchmark.Counter()
+  end
+  gc()
+end
+
+function loop_array(n)
+  result = 0.
+  for i in 1:n
+    result += CxxWrapBenchmark.array_sum(const_array)
+  end
+  return result
+end
+
+# Broadcast over the 1000 elements of const_array, with one call per element
+function loop_broadcast_scalar(n)
+  result = 0.
+  for i in 1:n
+    result += CxxWrapBenchmark.scalar_half.(const_array)[1]
+  end
+  return result
+end
+
+# The same broadcast, calling the vectorized overload once
+function loop_broadcast_vectorized(n)
+  result = 0.
+  for i in 1:n
+    result += CxxWrapBenchmark.vectorized_half.(const_array)[1]
+  end
+  return result
+end
+
+function loop_string_argument(n)
+  result = 0
+  for i in 1:n
+    result += CxxWrapBenchmark.string_length(const_string)
+  end
+  return result
+end
+
+function loop_string_return(n)
+  result = 0
+  for i in 1:n
+    result += length(CxxWrapBenchmark.make_string())
+  end
+  return result
+end
+
+function loop_tuple(n)
+  result = 0.
+  for i in 1:n
+    result += CxxWrapBenchmark.tuple_return(1.)[2]
+  end
+  return result
+end
+
+loop_julia_callback(n) = CxxWrapBenchmark.julia_callback_loop(n)
+loop_typed_julia_callback(n) = CxxWrapBenchmark.typed_julia_callback_loop(n)
+
+# Name, loop function and number of calls relative to nb_calls
+const benchmarks = [
+  ("function_pointer", loop_direct, 1),
+  ("std_function_thunk", loop_thunk, 1),
+  ("member_function", loop_member, 1),
+  ("member_function_direct", loop_member_direct, 1),
+  ("create_with_finalizer", loop_create, 10),
+  ("arrayref_sum_1000", loop_array, 10),
+  ("broadcast_scalar_1000", loop_broadcast_scalar, 1000),
+  ("broadcast_vectorized_1000", loop_broadcast_vectorized, 100),
+  ("string_argument", loop_string_argument, 10),
+  ("string_return", loop_string_return, 10),
+  ("tuple_return", loop_tuple, 10),
+  ("julia_function_callback", loop_julia_callback, 10),
+  ("typed_julia_function_callback", loop_typed_julia_callback, 1)
+]
+
+function run_benchmark(f, n)
+  f(1) # compile
+  gc()
+  return 1e9 * (@elapsed f(n)) / n
+end
+
+function write_json(io::IO, results)
+  println(io, "{")
+  for (i, (name, t)) in enumerate(results)
+    println(io, "  \"", name, "\": ", round(t, 3), i == length(results) ? "" : ",")
+  end
+  println(io, "}")
+end
+
+results = Tuple{String,Float64}[]
+for (name, f, divisor) in benchmarks
+  t = run_benchmark(f, nb_calls ÷ divisor)
+  println(STDERR, rpad(name, 32), round(t, 3), " ns/call")
+  push!(results, (name, t))
+end
+
+if isempty(ARGS)
+  write_json(STDOUT, results)
+else
+  open(io -> write_json(io, results), ARGS[1], "w")
+end
@@ -98,7 +98,7 @@ genopt = "Unix Makefiles"
 end
 
 # Functions library for testing
-example_labels = [:cxxwrap_containers, :except, :extended, :functions, :hello, :inheritance, :parametric, :types]
+example_labels = [:benchmark, :cxxwrap_containers, :except, :extended, :functions, :hello, :inheritance, :parametric, :types]
 examples = BinDeps.LibraryDependency[]
 for l in example_labels
   @eval $l = $(library_dependency(string(l), aliases=["lib"*string(l)]))
@@ -169,6 +169,7 @@ provides(BuildProcess,
 end
 
 @BinDeps.install Dict([(:cxx_wrap, :_l_cxx_wrap),
+                       (:benchmark, :_l_benchmark),
                        (:cxxwrap_containers, :_l_containers),
                        (:except, :_l_except),
                        (:extended, :_l_extended),
@@ -1,6 +1,13 @@
 #ifndef ARRAY_HPP
 #define ARRAY_HPP
 
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <vector>
+
+#include "thread_pool.hpp"
 #include "type_conversion.hpp"
 
 #include "containers/tuple.hpp"
@@ -79,6 +86,127 @@ public:
   }
 };
 
+namespace detail
+{
+  /// True if values of type T are stored unboxed in the memory of a Julia array. Immutables marked with IsBitsImmutable have the same layout in C++ and Julia.
+  /// Other immutables may have fields that Julia stores as references, so they are boxed.
+  template<typename T>
+  struct IsUnboxedElement
+  {
+    static constexpr bool value = IsFundamental<T>::value || IsBits<T>::value || (IsImmutable<T>::value && IsBitsImmutable<T>::value);
+  };
+
+  /// Type of the values stored in the memory of a Julia array with elements of type T
+  template<typename T>
+  using array_element_type = typename StaticIf<IsUnboxedElement<T>::value, T, mapped_julia_type<T>>::type;
+
+  /// True if all types are void or passed unboxed, so they can be passed directly to a cfunction or looped over in an array.
+  /// Immutables are excluded, since wrapped functions receive them boxed.
+  template<typename... TypesT>
+  struct AllUnboxed;
+
+  template<>
+  struct AllUnboxed<>
+  {
+    static constexpr bool value = true;
+  };
+
+  template<typename T, typename... TypesT>
+  struct AllUnboxed<T, TypesT...>
+  {
+    static constexpr bool value = (std::is_void<T>::value || IsFundamental<remove_const_ref<T>>::value || IsBits<remove_const_ref<T>>::value) && AllUnboxed<TypesT...>::value;
+  };
+
+  /// Write a range of values to a Julia array, starting at position pos
+  template<typename ValueT, bool Unboxed = IsUnboxedElement<ValueT>::value>
+  struct ArrayFiller
+  {
+    template<typename IteratorT>
+    void operator()(jl_array_t* arr, std::size_t pos, IteratorT first, IteratorT last) const
+    {
+      JL_GC_PUSH1(&arr);
+      for(; first != last; ++first, ++pos)
+      {
+        const ValueT& val = *first;
+        jl_arrayset(arr, box(val), pos);
+      }
+      JL_GC_POP();
+    }
+  };
+
+  // Bits values are copied directly, without boxing
+  template<typename ValueT>
+  struct ArrayFiller<ValueT, true>
+  {
+    template<typename IteratorT>
+    void operator()(jl_array_t* arr, std::size_t pos, IteratorT first, IteratorT last) const
+    {
+      std::copy(first, last, static_cast<ValueT*>(jl_array_data(arr)) + pos);
+    }
+
+    void operator()(jl_array_t* arr, std::size_t pos, const ValueT* first, const ValueT* last) const
+    {
+      if(first != last)
+      {
+        std::memcpy(static_cast<ValueT*>(jl_array_data(arr)) + pos, first, (last - first)*sizeof(ValueT));
+      }
+    }
+  };
+
+  /// Keep the C++ storage of a Julia array alive until the array is garbage collected, then call deleter(owner)
+  CXX_WRAP_EXPORT void own_array_storage(jl_array_t* arr, void* owner, void (*deleter)(void*));
+
+  template<typename OwnerT>
+  void delete_owner(void* owner)
+  {
+    delete static_cast<OwnerT*>(owner);
+  }
+
+  template<typename ValueT>
+  void delete_owner_array(void* owner)
+  {
+    delete[] static_cast<ValueT*>(owner);
+  }
+
+  /// Hand the storage of a unique_ptr to a Julia array, keeping a custom deleter alongside the pointer
+  template<typename ValueT, typename DeleterT>
+  struct OwnUniqueArray
+  {
+    void operator()(jl_array_t* arr, std::unique_ptr<ValueT[], DeleterT>&& ptr) const
+    {
+      own_array_storage(arr, new std::unique_ptr<ValueT[], DeleterT>(std::move(ptr)), delete_owner<std::unique_ptr<ValueT[], DeleterT>>);
+    }
+  };
+
+  template<typename ValueT>
+  struct OwnUniqueArray<ValueT, std::default_delete<ValueT[]>>
+  {
+    void operator()(jl_array_t* arr, std::unique_ptr<ValueT[]>&& ptr) const
+    {
+      own_array_storage(arr, ptr.release(), delete_owner_array<ValueT>);
+    }
+  };
+
+  /// C++ type matching the Julia Int used for array dimensions
+  typedef std::conditional<sizeof(void*) == 8, int64_t, int32_t>::type julia_int_t;
+
+  /// Append a range to a 1D Julia array, growing it only once
+  template<typename ValueT, typename IteratorT>
+  void append_to_array(jl_array_t* arr, IteratorT first, IteratorT last)
+  {
+    const std::size_t pos = jl_array_len(arr);
+    const std::size_t n = std::distance(first, last);
+    if(n == 0)
+    {
+      return;
+    }
+    JL_GC_PUSH1(&arr);
+    jl_array_grow_end(arr, n);
+    ArrayFiller<ValueT>()(arr, pos, first, last);
+    JL_GC_POP();
+  }
+}
+
 /// Wrap a Julia 1D array in a C++ class. Array is allocated on the C++ side
 template<typename ValueT>
 class Array
@@ -96,6 +224,18 @@ public:
     m_array = jl_alloc_array_1d(array_type, n);
   }
 
+  /// Construct from an iterator range, allocating the array only once
+  template<typename IteratorT, typename = typename std::enable_if<!std::is_integral<IteratorT>::value>::type>
+  Array(IteratorT first, IteratorT last) : Array(std::distance(first, last))
+  {
+    detail::ArrayFiller<ValueT>()(m_array, 0, first, last);
+  }
+
+  /// Copy the contents of a std::vector
+  Array(const std::vector<ValueT>& vec) : Array(vec.data(), vec.data() + vec.size())
+  {
+  }
+
   /// Append an element to the end of the list
   void push_back(const ValueT& val)
   {
@@ -106,8 +246,31 @@ public:
     JL_GC_POP();
   }
 
+  /// Append a range of elements, growing the array only once
+  template<typename IteratorT>
+  void append(IteratorT first, IteratorT last)
+  {
+    detail::append_to_array<ValueT>(m_array, first, last);
+  }
+
+  void append(const std::vector<ValueT>& vec)
+  {
+    append(vec.data(), vec.data() + vec.size());
+  }
+
+  /// Preallocate memory for n elements in total
+  void reserve(const std::size_t n)
+  {
+    jl_array_sizehint(m_array, n);
+  }
+
+  std::size_t size() const
+  {
+    return jl_array_len(m_array);
+  }
+
   /// Access to the wrapped array
-  jl_array_t* wrapped()
+  jl_array_t* wrapped() const
   {
     return m_array;
   }
@@ -158,12 +321,172 @@ struct IndexedArrayRef<ValueT,ValueT>
   jl_array_t* m_array;
 };
 
+namespace detail
+{
+  /// Offset of the element at the given indices, for the given strides
+  template<int N, typename... IndicesT>
+  inline std::ptrdiff_t strided_offset(const std::ptrdiff_t* strides, const IndicesT... indices)
+  {
+    static_assert(sizeof...(IndicesT) == N, "Number of indices must match the number of dimensions");
+    const std::ptrdiff_t idx[] = {static_cast<std::ptrdiff_t>(indices)...};
+    std::ptrdiff_t result = 0;
+    for(int d = 0; d != N; ++d)
+    {
+      result += idx[d]*strides[d];
+    }
+    return result;
+  }
+}
+
+namespace detail
+{
+  /// Number of elements from which bulk conversions are split over multiple threads
+  static constexpr std::size_t parallel_conversion_threshold = 1 << 15;
+
+  /// Call f(begin, end) on chunks covering [0, n), running the chunks on the shared thread pool if n is large.
+  /// f must not call into Julia.
+  template<typename FunctorT>
+  void for_each_chunk(const std::size_t n, const FunctorT& f)
+  {
+    if(n < parallel_conversion_threshold)
+    {
+      f(std::size_t(0), n);
+      return;
+    }
+    const std::size_t chunk_size = std::max(parallel_conversion_threshold / 2, (n + 4*thread_pool_size() - 1) / (4*thread_pool_size()));
+    parallel_for(n, chunk_size, f);
+  }
+
+  /// True if converting a boxed value to T only reads its memory, so it can run on threads that Julia doesn't manage
+  template<typename T> struct ConvertsWithoutRuntime : std::false_type {};
+  template<> struct ConvertsWithoutRuntime<std::string> : std::true_type {};
+  template<> struct ConvertsWithoutRuntime<StringRef> : std::true_type {};
+
+  /// Convert all elements of a Julia array to C++ at once
+  template<typename ValueT, bool Unboxed = IsUnboxedElement<ValueT>::value>
+  struct ArrayToVector
+  {
+    std::vector<ValueT> operator()(jl_array_t* arr) const
+    {
+      const std::size_t n = jl_array_len(arr);
+      jl_value_t** boxed = static_cast<jl_value_t**>(jl_array_data(arr));
+      std::vector<ValueT> result(n);
+      auto convert_chunk = [&result, boxed](const std::size_t begin, const std::size_t end)
+      {
+        for(std::size_t i = begin; i != end; ++i)
+        {
+          if(boxed[i] == nullptr)
+          {
+            throw std::runtime_error("Undefined element in array at index " + std::to_string(i));
+          }
+          result[i] = convert_to_cpp<ValueT>(boxed[i]);
+        }
+      };
+      // Other conversions look up Julia types, which is only allowed on the calling thread
+      if(ConvertsWithoutRuntime<ValueT>::value)
+      {
+        for_each_chunk(n, convert_chunk);
+      }
+      else
+      {
+        convert_chunk(std::size_t(0), n);
+      }
+      return result;
+    }
+  };
+
+  template<typename ValueT>
+  struct ArrayToVector<ValueT, true>
+  {
+    std::vector<ValueT> operator()(jl_array_t* arr) const
+    {
+      const ValueT* data = static_cast<const ValueT*>(jl_array_data(arr));
+      return std::vector<ValueT>(data, data + jl_array_len(arr));
+    }
+  };
+}
+
+/// Non-owning view of N-dimensional strided data of a bits type, corresponding to CxxWrap.StridedView in Julia.
+/// Extents and strides are in elements, indices are 0-based.
+template<typename ValueT, int N>
+class ArrayView
+{
+public:
+  /// Empty view, with all extents 0
+  ArrayView() : m_data(nullptr)
+  {
+    std::fill(m_extents, m_extents+N, 0);
+    std::fill(m_strides, m_strides+N, 0);
+  }
+
+  ArrayView(ValueT* data, const std::ptrdiff_t* extents, const std::ptrdiff_t* strides) : m_data(data)
+  {
+    std::copy(extents, extents+N, m_extents);
+    std::copy(strides, strides+N, m_strides);
+  }
+
+  ValueT* data() const
+  {
+    return m_data;
+  }
+
+  std::ptrdiff_t extent(const int d) const
+  {
+    assert(d >= 0 && d < N);
+    return m_extents[d];
+  }
+
+  std::ptrdiff_t stride(const int d) const
+  {
+    assert(d >= 0 && d < N);
+    return m_strides[d];
+  }
+
+  /// Total number of elements
+  std::size_t size() const
+  {
+    std::size_t result = 1;
+    for(int d = 0; d != N; ++d)
+    {
+      result *= m_extents[d];
+    }
+    return result;
+  }
+
+  template<typename... IndicesT>
+  ValueT& operator()(const IndicesT... indices) const
+  {
+    return m_data[detail::strided_offset<N>(m_strides, indices...)];
+  }
+
+  /// View of row i of a matrix
+  ArrayView<ValueT,1> row(const std::ptrdiff_t i) const
+  {
+    static_assert(N == 2, "Rows are only defined for matrices");
+    return ArrayView<ValueT,1>(m_data + i*m_strides[0], m_extents+1, m_strides+1);
+  }
+
+  /// View of column j of a matrix
+  ArrayView<ValueT,1> column(const std::ptrdiff_t j) const
+  {
+    static_assert(N == 2, "Columns are only defined for matrices");
+    return ArrayView<ValueT,1>(m_data + j*m_strides[1], m_extents, m_strides);
+  }
+
+private:
+  ValueT* m_data;
+  std::ptrdiff_t m_extents[N];
+  std::ptrdiff_t m_strides[N];
+};
+
+template<typename T, int N> struct IsBits<ArrayView<T,N>> : std::true_type {};
+
 /// Reference a Julia array in an STL-compatible wrapper
 template<typename ValueT, int Dim = 1>
-class ArrayRef : public IndexedArrayRef<mapped_julia_type<ValueT>, ValueT>
+class ArrayRef : public IndexedArrayRef<detail::array_element_type<ValueT>, ValueT>
 {
 public:
-  ArrayRef(jl_array_t* arr) : IndexedArrayRef<mapped_julia_type<ValueT>, ValueT>(arr)
+  ArrayRef(jl_array_t* arr) : IndexedArrayRef<detail::array_element_type<ValueT>, ValueT>(arr)
   {
     assert(wrapped() != nullptr);
   }
@@ -172,7 +495,20 @@ public:
   template<typename... SizesT>
   ArrayRef(ValueT* ptr, const SizesT... sizes);
 
-  typedef mapped_julia_type<ValueT> julia_t;
+  /// Take over the storage of a vector without copying. The vector is destroyed when the Julia array is garbage collected.
+  ArrayRef(std::vector<ValueT>&& vec) : ArrayRef(std::move(vec), vec.size())
+  {
+  }
+
+  /// Take over the storage of a vector, using the given sizes for each dimension
+  template<typename... SizesT>
+  ArrayRef(std::vector<ValueT>&& vec, const SizesT... sizes);
+
+  /// Take over a C-array owned by a unique_ptr, which is destroyed using its deleter when the Julia array is garbage collected
+  template<typename DeleterT, typename... SizesT>
+  ArrayRef(std::unique_ptr<ValueT[], DeleterT> ptr, const SizesT... sizes);
+
+  typedef detail::array_element_type<ValueT> julia_t;
 
   typedef array_iterator_base<julia_t, ValueT> iterator;
   typedef array_iterator_base<julia_t const, ValueT const> const_iterator;
@@ -211,6 +547,29 @@ public:
     JL_GC_POP();
   }
 
+  /// Append a range of elements, growing the array only once
+  template<typename IteratorT>
+  void append(IteratorT first, IteratorT last)
+  {
+    detail::append_to_array<ValueT>(wrapped(), first, last);
+  }
+
+  void append(const std::vector<ValueT>& vec)
+  {
+    append(vec.data(), vec.data() + vec.size());
+  }
+
+  /// Preallocate memory for n elements in total
+  void reserve(const std::size_t n)
+  {
+    jl_array_sizehint(wrapped(), n);
+  }
+
+  ValueT* data()
+  {
+    return (ValueT*)jl_array_data(wrapped());
+  }
+
   const ValueT* data() const
   {
     return (ValueT*)jl_array_data(wrapped());
@@ -220,9 +579,189 @@ public:
   {
     return jl_array_len(wrapped());
   }
+
+  /// Convert all elements to C++ in one pass, e.g. to loop repeatedly over strings or wrapped pointers without boxed lookups.
+  /// Large arrays are converted using multiple threads.
+  std::vector<ValueT> to_vector() const
+  {
+    return detail::ArrayToVector<ValueT>()(wrapped());
+  }
+
+  /// Number of elements along dimension d
+  std::ptrdiff_t extent(const int d) const
+  {
+    assert(d >= 0 && d < Dim && d < jl_array_ndims(wrapped()));
+    return jl_array_dim(wrapped(), d);
+  }
+
+  /// Distance in elements between consecutive elements along dimension d
+  std::ptrdiff_t stride(const int d) const
+  {
+    std::ptrdiff_t result = 1;
+    for(int i = 0; i != d; ++i)
+    {
+      result *= extent(i);
+    }
+    return result;
+  }
+
+  /// Element access using one 0-based index per dimension. The strides are computed from the array dimensions on each call, so loops over bits types should index view() instead.
+  template<typename... IndicesT>
+  auto operator()(const IndicesT... indices) -> decltype((*this)[0])
+  {
+    std::ptrdiff_t strides[Dim];
+    fill_strides(strides);
+    return (*this)[detail::strided_offset<Dim>(strides, indices...)];
+  }
+
+  /// Strided view on the data, without copying
+  ArrayView<ValueT, Dim> view() const
+  {
+    static_assert(detail::IsUnboxedElement<ValueT>::value, "Views are only supported for arrays of bits types");
+    std::ptrdiff_t extents[Dim];
+    std::ptrdiff_t strides[Dim];
+    for(int d = 0; d != Dim; ++d)
+    {
+      extents[d] = extent(d);
+    }
+    fill_strides(strides);
+    return ArrayView<ValueT, Dim>(static_cast<ValueT*>(jl_array_data(wrapped())), extents, strides);
+  }
+
+  ArrayView<ValueT,1> row(const std::ptrdiff_t i) const
+  {
+    return view().row(i);
+  }
+
+  ArrayView<ValueT,1> column(const std::ptrdiff_t j) const
+  {
+    return view().column(j);
+  }
+
+  /// Strided view on one field of all elements, e.g. arr.field_view(&Particle::x), without copying
+  template<typename FieldT, typename ClassT>
+  ArrayView<FieldT,1> field_view(FieldT ClassT::* member) const
+  {
+    static_assert(std::is_same<ClassT, ValueT>::value, "Field must be a member of the element type");
+    static_assert(Dim == 1, "Field views are only supported for 1D arrays");
+    static_assert(detail::IsUnboxedElement<ValueT>::value && detail::IsUnboxedElement<FieldT>::value, "Field views are only supported for arrays of bits types");
+    static_assert(sizeof(ValueT) % sizeof(FieldT) == 0, "The element size must be a multiple of the field size");
+    const std::ptrdiff_t extents[] = {static_cast<std::ptrdiff_t>(size())};
+    const std::ptrdiff_t strides[] = {static_cast<std::ptrdiff_t>(sizeof(ValueT) / sizeof(FieldT))};
+    ValueT* elements = static_cast<ValueT*>(jl_array_data(wrapped()));
+    return ArrayView<FieldT,1>(size() == 0 ? nullptr : &(elements->*member), extents, strides);
+  }
+
+private:
+  void fill_strides(std::ptrdiff_t* strides) const
+  {
+    std::ptrdiff_t s = 1;
+    for(int d = 0; d != Dim; ++d)
+    {
+      strides[d] = s;
+      s *= extent(d);
+    }
+  }
 };
 
+/// Copy of all strings in a Julia array, stored in a single buffer. The total size is computed first, so the data is allocated only once.
+class PackedStrings
+{
+public:
+  explicit PackedStrings(jl_array_t* arr)
+  {
+    const std::size_t n = jl_array_len(arr);
+    jl_value_t** boxed = static_cast<jl_value_t**>(jl_array_data(arr));
+    m_offsets.resize(n + 1);
+    m_offsets[0] = 0;
+    for(std::size_t i = 0; i != n; ++i)
+    {
+      if(boxed[i] == nullptr || !is_julia_string(boxed[i]))
+      {
+        throw std::runtime_error("Element " + std::to_string(i) + " of array is not a string");
+      }
+      m_offsets[i+1] = m_offsets[i] + julia_string_length(boxed[i]);
+    }
+    m_data.resize(m_offsets[n]);
+    for(std::size_t i = 0; i != n; ++i)
+    {
+      std::memcpy(m_data.data() + m_offsets[i], julia_string(boxed[i]), m_offsets[i+1] - m_offsets[i]);
+    }
+  }
+
+  explicit PackedStrings(const ArrayRef<std::string>& arr) : PackedStrings(arr.wrapped())
+  {
+  }
+
+  explicit PackedStrings(const ArrayRef<StringRef>& arr) : PackedStrings(arr.wrapped())
+  {
+  }
+
+  std::size_t size() const
+  {
+    return m_offsets.size() - 1;
+  }
+
+  /// Total number of bytes in all strings
+  std::size_t nb_bytes() const
+  {
+    return m_data.size();
+  }
+
+  /// View of string i, valid as long as this object
+  StringRef operator[](const std::size_t i) const
+  {
+    return StringRef(m_data.data() + m_offsets[i], m_offsets[i+1] - m_offsets[i]);
+  }
+
+  /// New Julia array with copies of the strings. The array is allocated once, but each element is a new Julia string.
+  Array<StringRef> to_julia() const
+  {
+    std::vector<StringRef> refs;
+    refs.reserve(size());
+    for(std::size_t i = 0; i != size(); ++i)
+    {
+      refs.push_back((*this)[i]);
+    }
+    return Array<StringRef>(refs);
+  }
+
+private:
+  std::vector<char> m_data;
+  std::vector<std::size_t> m_offsets;
+};
+
+/// Call f(begin, end) with pointers delimiting chunks of at most chunk_size elements of arr, spread over the shared thread pool.
+/// Only for arrays of unboxed values, so the worker threads never touch Julia objects. f must not call into Julia.
+template<typename ValueT, int Dim, typename FunctorT>
+void parallel_for(ArrayRef<ValueT, Dim>& arr, const std::size_t chunk_size, const FunctorT& f)
+{
+  static_assert(detail::IsUnboxedElement<ValueT>::value, "parallel_for requires an array of unboxed values");
+  ValueT* data = arr.data();
+  parallel_for(arr.size(), chunk_size, [data, &f](const std::size_t begin, const std::size_t end)
+  {
+    f(data + begin, data + end);
+  });
+}
+
 template<typename T, int Dim> struct IsValueType<ArrayRef<T,Dim>> : std::true_type {};
+template<typename T> struct IsValueType<Array<T>> : std::true_type {};
+
+template<typename T> struct static_type_mapping<Array<T>>
+{
+  typedef jl_array_t* type;
+  static jl_datatype_t* julia_type() { return (jl_datatype_t*)jl_apply_array_type(static_type_mapping<T>::julia_type(), 1); }
+};
+
+template<typename T>
+struct ConvertToJulia<Array<T>, false, false, false>
+{
+  template<typename ArrayT>
+  jl_array_t* operator()(ArrayT&& arr) const
+  {
+    return arr.wrapped();
+  }
+};
 
 // Conversions
 template<typename T, int Dim> struct static_type_mapping<ArrayRef<T, Dim>>
@@ -238,11 +777,31 @@ ArrayRef<ValueT, Dim>::ArrayRef(ValueT* c_ptr, const SizesT... sizes) : IndexedA
   jl_datatype_t* dt = static_type_mapping<ArrayRef<ValueT, Dim>>::julia_type();
   jl_value_t *dims = nullptr;
   JL_GC_PUSH1(&dims);
-  dims = convert_to_julia(std::make_tuple(sizes...));
+  dims = convert_to_julia(std::make_tuple(static_cast<detail::julia_int_t>(sizes)...));
   IndexedArrayRef<julia_t, ValueT>::m_array = jl_ptr_to_array((jl_value_t*)dt, c_ptr, dims, 0);
   JL_GC_POP();
 }
 
+template<typename ValueT, int Dim>
+template<typename... SizesT>
+ArrayRef<ValueT, Dim>::ArrayRef(std::vector<ValueT>&& vec, const SizesT... sizes) : ArrayRef(vec.data(), sizes...)
+{
+  static_assert(detail::IsUnboxedElement<ValueT>::value, "Only vectors of bits types can be moved to Julia");
+  static_assert(sizeof...(SizesT) == Dim, "Number of sizes must match the array dimension");
+  assert(jl_array_len(wrapped()) == vec.size());
+  // Moving the vector keeps the data pointer valid
+  detail::own_array_storage(wrapped(), new std::vector<ValueT>(std::move(vec)), detail::delete_owner<std::vector<ValueT>>);
+}
+
+template<typename ValueT, int Dim>
+template<typename DeleterT, typename... SizesT>
+ArrayRef<ValueT, Dim>::ArrayRef(std::unique_ptr<ValueT[], DeleterT> ptr, const SizesT... sizes) : ArrayRef(ptr.get(), sizes...)
+{
+  static_assert(detail::IsUnboxedElement<ValueT>::value, "Only arrays of bits types can be moved to Julia");
+  static_assert(sizeof...(SizesT) == Dim, "Number of sizes must match the array dimension");
+  detail::OwnUniqueArray<ValueT, DeleterT>()(wrapped(), std::move(ptr));
+}
+
 template<typename T, int Dim>
 struct ConvertToJulia<ArrayRef<T,Dim>, false, false, false>
 {
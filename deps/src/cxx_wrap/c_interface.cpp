@@ -1,5 +1,7 @@
 #include "array.hpp"
 #include "cxx_wrap.hpp"
+#include "event_queue.hpp"
+#include "thread_pool.hpp"
 
 extern "C"
 {
@@ -14,6 +16,7 @@ CXX_WRAP_EXPORT void initialize(jl_value_t* julia_module, jl_value_t* cpp_any_ty
   g_cxx_wrap_module = (jl_module_t*)julia_module;
   g_any_type = (jl_datatype_t*)cpp_any_type;
   g_cppfunctioninfo_type = (jl_datatype_t*)cppfunctioninfo_type;
+  detail::invalidate_type_cache();
 
   InitHooks::instance().run_hooks();
 }
@@ -39,14 +42,12 @@ CXX_WRAP_EXPORT jl_array_t* get_module_names(void* void_registry)
 {
   assert(void_registry != nullptr);
   const ModuleRegistry& registry = *reinterpret_cast<ModuleRegistry*>(void_registry);
-  Array<std::string> names_array;
-  JL_GC_PUSH1(names_array.gc_pointer());
+  std::vector<std::string> names;
   registry.for_each_module([&](Module& module)
   {
-    names_array.push_back(module.name());
+    names.push_back(module.name());
   });
-  JL_GC_POP();
-  return names_array.wrapped();
+  return Array<std::string>(names).wrapped();
 }
 
 /// Bind jl_datatype_t structures to corresponding Julia symbols in the given module
@@ -57,6 +58,8 @@ CXX_WRAP_EXPORT void bind_module_constants(void* void_registry, jl_value_t* modu
   jl_module_t* mod = (jl_module_t*)module_any;
   const std::string mod_name = symbol_name(mod->name);
   registry.get_module(mod_name).bind_constants(mod);
+  // The module may have been wrapped again, replacing the types found by earlier lookups
+  detail::invalidate_type_cache();
 }
 
 /// Get the functions defined in the modules. Any classes used by these functions must be defined on the Julia side first
@@ -73,17 +76,13 @@ CXX_WRAP_EXPORT jl_array_t* get_module_functions(void* void_registry)
 
     module.for_each_function([&](FunctionWrapperBase& f)
     {
+      f.bind(module.name());
       const std::vector<jl_datatype_t*> types_vec = f.argument_types();
-      Array<jl_datatype_t*> arg_types_array;
+      Array<jl_datatype_t*> arg_types_array(types_vec);
       jl_value_t* boxed_f = nullptr;
       jl_value_t* boxed_thunk = nullptr;
       JL_GC_PUSH3(arg_types_array.gc_pointer(), &boxed_f, &boxed_thunk);
 
-      for(const auto& t : types_vec)
-      {
-        arg_types_array.push_back(t);
-      }
-
       boxed_f = jl_box_voidpointer(f.pointer());
       boxed_thunk = jl_box_voidpointer(f.thunk());
 
@@ -106,17 +105,153 @@ CXX_WRAP_EXPORT jl_array_t* get_module_functions(void* void_registry)
   return module_array.wrapped();
 }
 
+/// Open a new arena that owns the objects created by the calling task until it is closed
+CXX_WRAP_EXPORT void* open_arena()
+{
+  return static_cast<void*>(new Arena());
+}
+
+/// Close the arena, deleting all the objects it owns
+CXX_WRAP_EXPORT void close_arena(void* arena)
+{
+  delete reinterpret_cast<Arena*>(arena);
+}
+
+/// Close the arena without deleting its objects, which are finalized by the garbage collector instead
+CXX_WRAP_EXPORT void release_arena(void* arena)
+{
+  Arena* cpp_arena = reinterpret_cast<Arena*>(arena);
+  cpp_arena->release();
+  delete cpp_arena;
+}
+
+CXX_WRAP_EXPORT std::size_t arena_size(void* arena)
+{
+  assert(arena != nullptr);
+  return reinterpret_cast<Arena*>(arena)->size();
+}
+
+/// Call statistics of the functions in instrumented modules
+CXX_WRAP_EXPORT jl_array_t* get_function_stats()
+{
+  return function_stats();
+}
+
+CXX_WRAP_EXPORT void clear_function_stats()
+{
+  reset_function_stats();
+}
+
+CXX_WRAP_EXPORT void enable_tracing(bool enabled)
+{
+  set_tracing(enabled);
+}
+
+/// Recorded trace events in the Chrome trace format
+CXX_WRAP_EXPORT jl_value_t* get_trace()
+{
+  return convert_to_julia(trace_json());
+}
+
+CXX_WRAP_EXPORT void clear_trace_events()
+{
+  clear_trace();
+}
+
+/// Number of threads used by parallel_for, including the calling thread
+CXX_WRAP_EXPORT std::size_t get_thread_pool_size()
+{
+  return thread_pool_size();
+}
+
+CXX_WRAP_EXPORT void resize_thread_pool(std::size_t nb_threads)
+{
+  set_thread_pool_size(nb_threads);
+}
+
+/// Memory reported by the live wrapped objects through SizeOf
+CXX_WRAP_EXPORT std::size_t get_external_memory()
+{
+  return external_memory();
+}
+
+CXX_WRAP_EXPORT void change_external_gc_interval(std::size_t nb_bytes)
+{
+  set_external_gc_interval(nb_bytes);
+}
+
+/// Run an asynchronous call on the thread pool, signaling the libuv async handle of a Base.AsyncCondition when it is done
+CXX_WRAP_EXPORT void start_async_call(void* call, void* async_handle)
+{
+  detail::AsyncCallBase* async_call = reinterpret_cast<detail::AsyncCallBase*>(call);
+  uv_async_s* handle = reinterpret_cast<uv_async_s*>(async_handle);
+  detail::submit_task([async_call, handle]()
+  {
+    async_call->run();
+    uv_async_send(handle);
+  });
+}
+
+/// Convert the result of a finished asynchronous call and delete it, on the Julia thread
+CXX_WRAP_EXPORT jl_value_t* finish_async_call(void* call)
+{
+  detail::AsyncCallBase* async_call = reinterpret_cast<detail::AsyncCallBase*>(call);
+  jl_value_t* result = nullptr;
+  try
+  {
+    result = async_call->result();
+  }
+  catch(const std::runtime_error& err)
+  {
+    delete async_call;
+    jl_error(err.what());
+  }
+  delete async_call;
+  return result;
+}
+
+/// Signal the libuv async handle of a Base.AsyncCondition when events arrive in the queue, or stop signaling if it is null
+CXX_WRAP_EXPORT void attach_event_queue(void* queue, void* async_handle)
+{
+  reinterpret_cast<detail::EventQueueBase*>(queue)->attach(reinterpret_cast<uv_async_s*>(async_handle));
+}
+
+CXX_WRAP_EXPORT bool event_queue_ready(void* queue)
+{
+  const detail::EventQueueBase& q = *reinterpret_cast<detail::EventQueueBase*>(queue);
+  return !q.empty() || q.is_closed();
+}
+
+/// Array with the queued events, or nothing if the queue was closed and all events were taken
+CXX_WRAP_EXPORT jl_value_t* take_event_batch(void* queue)
+{
+  detail::EventQueueBase& q = *reinterpret_cast<detail::EventQueueBase*>(queue);
+  if(q.is_closed() && q.empty())
+  {
+    return jl_nothing;
+  }
+  return q.take_batch();
+}
+
 CXX_WRAP_EXPORT jl_array_t* get_exported_symbols(void* void_registry, jl_value_t* mod_name)
 {
   assert(void_registry != nullptr);
   ModuleRegistry& registry = *reinterpret_cast<ModuleRegistry*>(void_registry);
-  Array<std::string> syms;
-  for(auto&& sym_name : registry.get_module(convert_to_cpp<std::string>(mod_name)).exported_symbols())
-  {
-    syms.push_back(sym_name);
-  }
+  return Array<std::string>(registry.get_module(convert_to_cpp<std::string>(mod_name)).exported_symbols()).wrapped();
+}
 
-  return syms.wrapped();
+CXX_WRAP_EXPORT bool module_has_types(void* void_registry, jl_value_t* mod_name)
+{
+  assert(void_registry != nullptr);
+  ModuleRegistry& registry = *reinterpret_cast<ModuleRegistry*>(void_registry);
+  return registry.get_module(convert_to_cpp<std::string>(mod_name)).has_types();
+}
+
+CXX_WRAP_EXPORT jl_array_t* get_vectorized_functions(void* void_registry, jl_value_t* mod_name)
+{
+  assert(void_registry != nullptr);
+  ModuleRegistry& registry = *reinterpret_cast<ModuleRegistry*>(void_registry);
+  return Array<std::string>(registry.get_module(convert_to_cpp<std::string>(mod_name)).vectorized_functions()).wrapped();
 }
 
 }
@@ -45,6 +45,27 @@ namespace detail
   {
     typedef std::tuple<TypesT...> type;
   };
+
+  // Copy the elements of a tuple of sizes into an array
+  template<std::size_t I, std::size_t N>
+  struct SizesToArray
+  {
+    template<typename TupleT>
+    void operator()(const TupleT& sizes, index_t* result) const
+    {
+      result[I] = std::get<I>(sizes);
+      SizesToArray<I+1,N>()(sizes, result);
+    }
+  };
+
+  template<std::size_t N>
+  struct SizesToArray<N,N>
+  {
+    template<typename TupleT>
+    void operator()(const TupleT&, index_t*) const
+    {
+    }
+  };
 }
 
 /// Wrap a const pointer
@@ -92,6 +113,33 @@ public:
     return m_arr[i-1];
   }
 
+  /// Element access using one 0-based index per dimension, in column-major order
+  template<typename... IndicesT>
+  const T& operator()(const IndicesT... indices) const
+  {
+    static_assert(sizeof...(IndicesT) == N, "Number of indices must match the number of dimensions");
+    const index_t idx[] = {static_cast<index_t>(indices)...};
+    index_t sizes[N];
+    detail::SizesToArray<0,N>()(m_sizes, sizes);
+    index_t offset = 0;
+    index_t stride = 1;
+    for(index_t d = 0; d != N; ++d)
+    {
+      offset += idx[d]*stride;
+      stride *= sizes[d];
+    }
+    return m_arr[offset];
+  }
+
+  /// Number of elements along dimension d
+  index_t extent(const index_t d) const
+  {
+    assert(d >= 0 && d < N);
+    index_t sizes[N];
+    detail::SizesToArray<0,N>()(m_sizes, sizes);
+    return sizes[d];
+  }
+
   size_t size() const
   {
     return m_sizes;
@@ -0,0 +1,157 @@
+#ifndef CXX_WRAPPER_STRUCT_OF_ARRAYS_HPP
+#define CXX_WRAPPER_STRUCT_OF_ARRAYS_HPP
+
+#include <tuple>
+
+#include "../array.hpp"
+#include "tuple.hpp"
+
+namespace cxx_wrap
+{
+
+/// Structure of arrays with one Julia vector per field, corresponding to a Julia Tuple{Vector{FieldsT}...}.
+/// Each column is contiguous, so loops over a single field vectorize on both sides.
+template<typename... FieldsT>
+class StructOfArrays
+{
+  static_assert(sizeof...(FieldsT) != 0, "StructOfArrays needs at least one field");
+  static_assert(detail::AllBitsElements<FieldsT...>::value, "StructOfArrays fields must be bits types");
+
+public:
+  template<int I>
+  using field_type = typename std::tuple_element<I, std::tuple<FieldsT...>>::type;
+
+  /// Allocate the columns, each with n elements
+  explicit StructOfArrays(const std::size_t n)
+  {
+    jl_value_t** columns;
+    JL_GC_PUSHARGS(columns, sizeof...(FieldsT));
+    allocate_columns(columns, n, typename detail::GenerateSequence<sizeof...(FieldsT)>::type());
+    m_columns = jl_new_structv(julia_type<StructOfArrays<FieldsT...>>(), columns, sizeof...(FieldsT));
+    JL_GC_POP();
+  }
+
+  /// Reference an existing tuple of columns
+  explicit StructOfArrays(jl_value_t* columns) : m_columns(columns)
+  {
+    const std::size_t n = size();
+    for(std::size_t i = 1; i != sizeof...(FieldsT); ++i)
+    {
+      if(jl_array_len((jl_array_t*)jl_fieldref(m_columns, i)) != n)
+      {
+        throw std::runtime_error("All columns of a StructOfArrays must have the same length");
+      }
+    }
+  }
+
+  /// Copy the given fields of each element of a Julia array into new columns
+  template<typename T>
+  static StructOfArrays from_structs(const ArrayRef<T>& structs, FieldsT T::*... members)
+  {
+    StructOfArrays result(structs.size());
+    result.gather(structs.data(), typename detail::GenerateSequence<sizeof...(FieldsT)>::type(), members...);
+    return result;
+  }
+
+  /// Copy the columns back into the given fields of each element of a Julia array of the same size
+  template<typename T>
+  void to_structs(ArrayRef<T>& structs, FieldsT T::*... members) const
+  {
+    if(structs.size() != size())
+    {
+      throw std::runtime_error("StructOfArrays size " + std::to_string(size()) + " doesn't match array size " + std::to_string(structs.size()));
+    }
+    scatter(structs.data(), typename detail::GenerateSequence<sizeof...(FieldsT)>::type(), members...);
+  }
+
+  std::size_t size() const
+  {
+    return jl_array_len((jl_array_t*)jl_fieldref(m_columns, 0));
+  }
+
+  /// The Julia vector holding field I, without copying
+  template<int I>
+  ArrayRef<field_type<I>> column() const
+  {
+    return ArrayRef<field_type<I>>((jl_array_t*)jl_fieldref(m_columns, I));
+  }
+
+  /// The Julia tuple of columns
+  jl_value_t* wrapped() const
+  {
+    return m_columns;
+  }
+
+private:
+  template<int... S>
+  void allocate_columns(jl_value_t** columns, const std::size_t n, detail::Sequence<S...>)
+  {
+    auto dummy = {0, (columns[S] = (jl_value_t*)Array<FieldsT>(n).wrapped(), 0)...};
+    (void)dummy;
+  }
+
+  template<typename T, int... S>
+  void gather(const T* structs, detail::Sequence<S...>, FieldsT T::*... members)
+  {
+    const std::size_t n = size();
+    auto dummy = {0, (gather_field(column<S>().data(), structs, n, members), 0)...};
+    (void)dummy;
+  }
+
+  template<typename T, int... S>
+  void scatter(T* structs, detail::Sequence<S...>, FieldsT T::*... members) const
+  {
+    const std::size_t n = size();
+    auto dummy = {0, (scatter_field(column<S>().data(), structs, n, members), 0)...};
+    (void)dummy;
+  }
+
+  template<typename FieldT, typename T>
+  static void gather_field(FieldT* column, const T* structs, const std::size_t n, FieldT T::* member)
+  {
+    for(std::size_t i = 0; i != n; ++i)
+    {
+      column[i] = structs[i].*member;
+    }
+  }
+
+  template<typename FieldT, typename T>
+  static void scatter_field(const FieldT* column, T* structs, const std::size_t n, FieldT T::* member)
+  {
+    for(std::size_t i = 0; i != n; ++i)
+    {
+      structs[i].*member = column[i];
+    }
+  }
+
+  jl_value_t* m_columns;
+};
+
+template<typename... FieldsT> struct IsValueType<StructOfArrays<FieldsT...>> : std::true_type {};
+
+template<typename... FieldsT> struct static_type_mapping<StructOfArrays<FieldsT...>>
+{
+  typedef jl_value_t* type;
+  static jl_datatype_t* julia_type() { return static_type_mapping<std::tuple<ArrayRef<FieldsT>...>>::julia_type(); }
+};
+
+template<typename... FieldsT>
+struct ConvertToJulia<StructOfArrays<FieldsT...>, false, false, false>
+{
+  jl_value_t* operator()(const StructOfArrays<FieldsT...>& soa) const
+  {
+    return soa.wrapped();
+  }
+};
+
+template<typename... FieldsT>
+struct ConvertToCpp<StructOfArrays<FieldsT...>, false, false, false>
+{
+  StructOfArrays<FieldsT...> operator()(jl_value_t* columns) const
+  {
+    return StructOfArrays<FieldsT...>(columns);
+  }
+};
+
+} // namespace cxx_wrap
+#endif
@@ -1,6 +1,7 @@
 #ifndef CXX_WRAPPER_TUPLE_HPP
 #define CXX_WRAPPER_TUPLE_HPP
 
+#include <cstring>
 #include <tuple>
 
 #include "../type_conversion.hpp"
@@ -56,8 +57,34 @@ namespace detail
     typedef Sequence<S...> type;
   };
 
+  /// True if all elements map to the same type in Julia, so they are stored inline in the tuple
+  template<typename... TypesT>
+  struct AllBitsElements;
+
+  template<>
+  struct AllBitsElements<>
+  {
+    static constexpr bool value = true;
+  };
+
+  template<typename T, typename... TypesT>
+  struct AllBitsElements<T, TypesT...>
+  {
+    static constexpr bool value = std::is_same<mapped_julia_type<remove_const_ref<T>>, remove_const_ref<T>>::value && AllBitsElements<TypesT...>::value;
+  };
+
+  /// Copy a bits value directly into the tuple storage
+  template<typename T>
+  int tuple_write(jl_value_t* tup, jl_datatype_t* dt, std::size_t i, const T& v)
+  {
+    const mapped_julia_type<T> julia_val = convert_to_julia(v);
+    static_assert(sizeof(julia_val) == sizeof(T), "Bits tuple element has a different size in Julia");
+    std::memcpy(reinterpret_cast<char*>(jl_data_ptr(tup)) + jl_field_offset(dt, i), &julia_val, sizeof(julia_val));
+    return 0;
+  }
+
   template<typename TupleT, int... S>
-  jl_value_t* new_jl_tuple(Sequence<S...>, jl_datatype_t* dt, const TupleT& tp)
+  jl_value_t* new_jl_tuple(Sequence<S...>, jl_datatype_t* dt, const TupleT& tp, std::false_type)
   {
     jl_value_t* result = nullptr;
     JL_GC_PUSH1(&result);
@@ -66,6 +93,16 @@ namespace detail
     JL_GC_POP();
     return result;
   }
+
+  /// Tuples of bits types are filled in place, allocating only the tuple itself
+  template<typename TupleT, int... S>
+  jl_value_t* new_jl_tuple(Sequence<S...>, jl_datatype_t* dt, const TupleT& tp, std::true_type)
+  {
+    jl_value_t* result = jl_new_struct_uninit(dt);
+    auto dummy = {0, tuple_write(result, dt, S, std::get<S>(tp))...};
+    (void)dummy;
+    return result;
+  }
 }
 
 template<typename... TypesT> struct static_type_mapping<std::tuple<TypesT...>>
@@ -74,17 +111,17 @@ template<typename... TypesT> struct static_type_mapping<std::tuple<TypesT...>>
 
   static jl_datatype_t* julia_type()
   {
-    static jl_datatype_t* tuple_type = nullptr;
-    if(tuple_type == nullptr)
+    return detail::cached_julia_type([]()
     {
+      jl_datatype_t* tuple_type = nullptr;
       jl_svec_t* params = nullptr;
       JL_GC_PUSH2(&tuple_type, &params);
       params = jl_svec(sizeof...(TypesT), cxx_wrap::julia_type<TypesT>()...);
       tuple_type = jl_apply_tuple_type(params);
       protect_from_gc(tuple_type);
       JL_GC_POP();
-    }
-    return tuple_type;
+      return tuple_type;
+    });
   }
 };
 
@@ -93,7 +130,7 @@ struct ConvertToJulia<std::tuple<TypesT...>, false, false, false>
 {
   jl_value_t* operator()(const std::tuple<TypesT...>& tp)
   {
-    return detail::new_jl_tuple(typename detail::GenerateSequence<sizeof...(TypesT)>::type(), julia_type<std::tuple<TypesT...>>(), tp);
+    return detail::new_jl_tuple(typename detail::GenerateSequence<sizeof...(TypesT)>::type(), julia_type<std::tuple<TypesT...>>(), tp, std::integral_constant<bool, detail::AllBitsElements<TypesT...>::value>());
   }
 };
 
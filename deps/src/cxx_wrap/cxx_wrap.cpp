@@ -1,3 +1,10 @@
+#include <algorithm>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
 #include "cxx_wrap.hpp"
 
 #include <julia.h>
@@ -27,16 +34,539 @@ CXX_WRAP_EXPORT jl_array_t* gc_protected()
   return m_arr;
 }
 
-CXX_WRAP_EXPORT std::stack<std::size_t>& gc_free_stack()
+namespace
+{
+
+/// Mutex for the root table that can be locked again by its owner. The owner may trigger a collection, and finalizers
+/// running on the same thread, e.g. of a Julia Arena, then remove their roots.
+class GcRootMutex
+{
+public:
+  /// Lock while staying at a GC safepoint: a thread blocked in lock() would stop a collection started by the owner
+  void lock()
+  {
+    const std::thread::id self = std::this_thread::get_id();
+    if(m_owner.load(std::memory_order_relaxed) == self)
+    {
+      ++m_depth;
+      return;
+    }
+    while(!m_mutex.try_lock())
+    {
+#if JULIA_VERSION_MAJOR == 0 && JULIA_VERSION_MINOR > 4
+      jl_gc_safepoint();
+#endif
+      std::this_thread::yield();
+    }
+    m_owner.store(self, std::memory_order_relaxed);
+    m_depth = 1;
+  }
+
+  void unlock()
+  {
+    if(--m_depth == 0)
+    {
+      m_owner.store(std::thread::id(), std::memory_order_relaxed);
+      m_mutex.unlock();
+    }
+  }
+
+private:
+  std::mutex m_mutex;
+  std::atomic<std::thread::id> m_owner;
+  std::size_t m_depth = 0;
+};
+
+/// Dense table of GC roots: values live in the slots of the gc_protected() array, and an open-addressing index maps each value to its slot
+class GcRootTable
+{
+public:
+  void protect(jl_value_t* val)
+  {
+    reserve(1);
+    std::size_t i = find(val);
+    if(m_index[i].value != nullptr)
+    {
+      ++m_index[i].count;
+      return;
+    }
+
+    const std::size_t slot = m_free_slots.back();
+    m_free_slots.pop_back();
+    jl_arrayset(gc_protected(), val, slot);
+    m_index[i] = {val, slot, 1};
+    ++m_nb_entries;
+  }
+
+  void unprotect(jl_value_t* val)
+  {
+    const std::size_t i = m_index.empty() ? 0 : find(val);
+    if(m_index.empty() || m_index[i].value == nullptr)
+    {
+      std::cout << "WARNING: attempt to unprotect a jl_value_t* that was never protected" << std::endl;
+      return;
+    }
+
+    if(--m_index[i].count != 0)
+    {
+      return;
+    }
+
+    const std::size_t slot = m_index[i].slot;
+    jl_arrayset(gc_protected(), jl_nothing, slot);
+    m_free_slots.push_back(slot);
+    erase(i);
+    --m_nb_entries;
+  }
+
+  /// Make room for n new values, both in the root array and in the index
+  void reserve(const std::size_t n)
+  {
+    if(m_free_slots.size() < n)
+    {
+      grow_slots(n - m_free_slots.size());
+    }
+    if(2*(m_nb_entries + n) > m_index.size())
+    {
+      grow_index(m_nb_entries + n);
+    }
+  }
+
+private:
+  struct IndexEntry
+  {
+    jl_value_t* value;
+    std::size_t slot;
+    std::size_t count;
+  };
+
+  std::size_t home(jl_value_t* val) const
+  {
+    std::size_t h = reinterpret_cast<std::uintptr_t>(val) >> 4;
+    h *= static_cast<std::size_t>(0x9E3779B97F4A7C15ULL);
+    return (h ^ (h >> 16)) & (m_index.size() - 1);
+  }
+
+  /// Position of val in the index, or of the empty entry where it should be inserted
+  std::size_t find(jl_value_t* val) const
+  {
+    const std::size_t mask = m_index.size() - 1;
+    std::size_t i = home(val);
+    while(m_index[i].value != nullptr && m_index[i].value != val)
+    {
+      i = (i + 1) & mask;
+    }
+    return i;
+  }
+
+  /// Remove entry i using backward-shift deletion, so no tombstones are needed
+  void erase(std::size_t i)
+  {
+    const std::size_t mask = m_index.size() - 1;
+    std::size_t j = i;
+    while(true)
+    {
+      j = (j + 1) & mask;
+      if(m_index[j].value == nullptr)
+      {
+        break;
+      }
+      const std::size_t k = home(m_index[j].value);
+      const bool stays = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+      if(!stays)
+      {
+        m_index[i] = m_index[j];
+        i = j;
+      }
+    }
+    m_index[i].value = nullptr;
+  }
+
+  /// Geometric growth of the root array, adding at least min_extra free slots
+  void grow_slots(const std::size_t min_extra)
+  {
+    jl_array_t* arr = gc_protected();
+    const std::size_t old_len = jl_array_len(arr);
+    const std::size_t extra = std::max(min_extra, std::max(old_len, std::size_t(16)));
+    // Finalizers must not change the table or grow the array while it is being grown, so no collection may run here
+    const int gc_was_enabled = jl_gc_enable(0);
+    jl_array_grow_end(arr, extra);
+    jl_gc_enable(gc_was_enabled);
+    jl_value_t** data = (jl_value_t**)jl_array_data(arr);
+    m_free_slots.reserve(m_free_slots.size() + extra);
+    for(std::size_t i = 0; i != extra; ++i)
+    {
+      const std::size_t slot = old_len + extra - 1 - i;
+      data[slot] = jl_nothing;
+      m_free_slots.push_back(slot); // lowest slots are handed out first
+    }
+  }
+
+  void grow_index(const std::size_t min_entries)
+  {
+    std::size_t new_size = std::max(m_index.size(), std::size_t(32));
+    while(new_size < 2*min_entries)
+    {
+      new_size *= 2;
+    }
+    std::vector<IndexEntry> old_index(new_size, IndexEntry({nullptr, 0, 0}));
+    old_index.swap(m_index);
+    for(const IndexEntry& e : old_index)
+    {
+      if(e.value != nullptr)
+      {
+        m_index[find(e.value)] = e;
+      }
+    }
+  }
+
+  std::vector<IndexEntry> m_index;
+  std::size_t m_nb_entries = 0;
+  std::vector<std::size_t> m_free_slots;
+};
+
+GcRootTable& gc_root_table()
+{
+  static GcRootTable m_table;
+  return m_table;
+}
+
+/// Guards the root table. This is a single global lock: roots are added when registering types and opening arenas, not when creating objects.
+GcRootMutex& gc_root_mutex()
 {
-  static std::stack<std::size_t> m_stack;
-  return m_stack;
+  static GcRootMutex m_mutex;
+  return m_mutex;
+}
+
+}
+
+namespace detail
+{
+
+CXX_WRAP_EXPORT void gc_protect(jl_value_t* val)
+{
+  JL_GC_PUSH1(&val);
+  {
+    std::lock_guard<GcRootMutex> lock(gc_root_mutex());
+    gc_root_table().protect(val);
+  }
+  JL_GC_POP();
 }
 
-CXX_WRAP_EXPORT std::map<jl_value_t*, std::size_t>& gc_index_map()
+CXX_WRAP_EXPORT void gc_unprotect(jl_value_t* val)
 {
-  static std::map<jl_value_t*, std::size_t> m_map;
-  return m_map;
+  std::lock_guard<GcRootMutex> lock(gc_root_mutex());
+  gc_root_table().unprotect(val);
+}
+
+CXX_WRAP_EXPORT void gc_reserve(std::size_t n)
+{
+  std::lock_guard<GcRootMutex> lock(gc_root_mutex());
+  gc_root_table().reserve(n);
+}
+
+namespace
+{
+
+struct ArrayOwner
+{
+  void* owner;
+  void (*deleter)(void*);
+};
+
+/// C++ objects owning the data of Julia arrays, indexed by array
+std::unordered_map<jl_value_t*, ArrayOwner>& array_owners()
+{
+  static std::unordered_map<jl_value_t*, ArrayOwner> m_owners;
+  return m_owners;
+}
+
+/// Guards array_owners(). Finalizers may run on any thread.
+std::mutex& array_owners_mutex()
+{
+  static std::mutex m_mutex;
+  return m_mutex;
+}
+
+void array_owner_finalizer(jl_value_t* arr)
+{
+  ArrayOwner owner;
+  {
+    std::lock_guard<std::mutex> lock(array_owners_mutex());
+    auto it = array_owners().find(arr);
+    if(it == array_owners().end())
+    {
+      return;
+    }
+    owner = it->second;
+    array_owners().erase(it);
+  }
+  owner.deleter(owner.owner);
+}
+
+#if JULIA_VERSION_MAJOR == 0 && JULIA_VERSION_MINOR < 5
+jl_value_t* array_owner_finalizer_closure(jl_value_t *F, jl_value_t **args, uint32_t nargs)
+{
+  array_owner_finalizer(args[0]);
+  return nullptr;
+}
+#endif
+
+jl_function_t* array_owner_finalizer_function()
+{
+  // Threads racing on the first call each create an equivalent finalizer, one of them is kept
+  static std::atomic<jl_function_t*> m_finalizer(nullptr);
+  jl_function_t* result = m_finalizer.load(std::memory_order_acquire);
+  if(result == nullptr)
+  {
+#if JULIA_VERSION_MAJOR == 0 && JULIA_VERSION_MINOR < 5
+    result = jl_new_closure(array_owner_finalizer_closure, (jl_value_t*)jl_emptysvec, NULL);
+#else
+    result = jl_box_voidpointer((void*)array_owner_finalizer);
+#endif
+    protect_from_gc(result);
+    m_finalizer.store(result, std::memory_order_release);
+  }
+  return result;
+}
+
+}
+
+namespace
+{
+
+static constexpr std::int64_t default_external_gc_interval = std::int64_t(64) << 20;
+
+/// Bytes reported by the live objects
+std::atomic<std::int64_t> g_external_bytes{0};
+std::atomic<std::int64_t> g_external_since_gc{0};
+std::atomic<std::int64_t> g_external_gc_interval{default_external_gc_interval};
+/// Bytes to add before the next collection: the interval, or the live bytes after the last collection if that is more
+std::atomic<std::int64_t> g_external_gc_threshold{default_external_gc_interval};
+
+/// Size counted for each live object, so the same amount is uncounted when it is deleted
+std::unordered_map<const void*, std::size_t>& external_sizes()
+{
+  static std::unordered_map<const void*, std::size_t> m_sizes;
+  return m_sizes;
+}
+
+std::mutex& external_sizes_mutex()
+{
+  static std::mutex m_mutex;
+  return m_mutex;
+}
+
+}
+
+CXX_WRAP_EXPORT void add_external_memory(const void* obj, const std::size_t nb_bytes)
+{
+  if(nb_bytes == 0)
+  {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(external_sizes_mutex());
+    external_sizes()[obj] = nb_bytes;
+  }
+  g_external_bytes.fetch_add(nb_bytes, std::memory_order_relaxed);
+  std::int64_t since_gc = g_external_since_gc.fetch_add(nb_bytes, std::memory_order_relaxed) + nb_bytes;
+  // Only the thread that resets the counter collects
+  if(since_gc >= g_external_gc_threshold.load(std::memory_order_relaxed) && g_external_since_gc.compare_exchange_strong(since_gc, 0))
+  {
+    jl_gc_collect(1);
+    // Like the heap itself, wait for the live memory to double before collecting again, so collections don't become quadratic
+    g_external_gc_threshold.store(std::max(g_external_gc_interval.load(), g_external_bytes.load()));
+  }
+}
+
+CXX_WRAP_EXPORT void remove_external_memory(const void* obj)
+{
+  std::size_t nb_bytes = 0;
+  {
+    std::lock_guard<std::mutex> lock(external_sizes_mutex());
+    auto found = external_sizes().find(obj);
+    if(found == external_sizes().end())
+    {
+      return;
+    }
+    nb_bytes = found->second;
+    external_sizes().erase(found);
+  }
+  g_external_bytes.fetch_sub(nb_bytes, std::memory_order_relaxed);
+}
+
+CXX_WRAP_EXPORT void own_array_storage(jl_array_t* arr, void* owner, void (*deleter)(void*))
+{
+  JL_GC_PUSH1(&arr);
+  {
+    std::lock_guard<std::mutex> lock(array_owners_mutex());
+    array_owners()[(jl_value_t*)arr] = ArrayOwner({owner, deleter});
+  }
+  jl_gc_add_finalizer((jl_value_t*)arr, array_owner_finalizer_function());
+  JL_GC_POP();
+}
+
+}
+
+CXX_WRAP_EXPORT std::size_t external_memory()
+{
+  return detail::g_external_bytes.load();
+}
+
+CXX_WRAP_EXPORT void set_external_gc_interval(const std::size_t nb_bytes)
+{
+  detail::g_external_gc_interval.store(nb_bytes == 0 ? detail::default_external_gc_interval : std::int64_t(nb_bytes));
+  detail::g_external_gc_threshold.store(std::max(detail::g_external_gc_interval.load(), detail::g_external_bytes.load()));
+}
+
+namespace
+{
+
+/// Arenas that are open, in the order they were opened. Each belongs to the task that opened it.
+std::vector<Arena*>& open_arenas()
+{
+  static std::vector<Arena*> m_arenas;
+  return m_arenas;
+}
+
+/// Guards open_arenas(), no Julia functions are called while it is locked
+std::mutex& open_arenas_mutex()
+{
+  static std::mutex m_mutex;
+  return m_mutex;
+}
+
+/// Number of open arenas, so creating objects doesn't lock when there are none
+std::atomic<std::size_t> g_nb_open_arenas{0};
+
+}
+
+Arena::Arena() : m_task(jl_gc_new_weakref((jl_value_t*)jl_current_task))
+{
+  protect_from_gc(m_task);
+#if JULIA_VERSION_MAJOR == 0 && JULIA_VERSION_MINOR > 4
+  jl_value_t* array_type = jl_apply_array_type(jl_any_type, 1);
+  m_wrappers = jl_alloc_array_1d(array_type, 0);
+#else
+  m_wrappers = jl_alloc_cell_1d(0);
+#endif
+  protect_from_gc(m_wrappers);
+  std::lock_guard<std::mutex> lock(open_arenas_mutex());
+  open_arenas().push_back(this);
+  g_nb_open_arenas.fetch_add(1);
+}
+
+Arena::~Arena()
+{
+  close();
+}
+
+void Arena::adopt(jl_value_t* wrapper, finalizer_t finalizer, jl_function_t* gc_finalizer)
+{
+  assert(is_open());
+  JL_GC_PUSH1(&wrapper);
+  const std::size_t pos = jl_array_len(m_wrappers);
+  jl_array_grow_end(m_wrappers, 1);
+  jl_arrayset(m_wrappers, wrapper, pos);
+  m_finalizers.push_back(finalizer);
+  m_gc_finalizers.push_back(gc_finalizer);
+  JL_GC_POP();
+}
+
+void Arena::close()
+{
+  if(!is_open())
+  {
+    return;
+  }
+
+  unregister();
+
+  for(std::size_t i = m_finalizers.size(); i != 0; --i)
+  {
+    m_finalizers[i-1](jl_arrayref(m_wrappers, i-1));
+  }
+  m_finalizers.clear();
+  m_gc_finalizers.clear();
+
+  unprotect_from_gc(m_wrappers);
+  unprotect_from_gc(m_task);
+  m_wrappers = nullptr;
+}
+
+void Arena::release()
+{
+  if(!is_open())
+  {
+    return;
+  }
+
+  unregister();
+
+  for(std::size_t i = 0; i != m_gc_finalizers.size(); ++i)
+  {
+    jl_gc_add_finalizer(jl_arrayref(m_wrappers, i), m_gc_finalizers[i]);
+  }
+  m_finalizers.clear();
+  m_gc_finalizers.clear();
+
+  unprotect_from_gc(m_wrappers);
+  unprotect_from_gc(m_task);
+  m_wrappers = nullptr;
+}
+
+void Arena::unregister()
+{
+  std::lock_guard<std::mutex> lock(open_arenas_mutex());
+  std::vector<Arena*>& arenas = open_arenas();
+  arenas.erase(std::remove(arenas.begin(), arenas.end(), this), arenas.end());
+  g_nb_open_arenas.fetch_sub(1);
+}
+
+Arena* Arena::current()
+{
+  if(g_nb_open_arenas.load(std::memory_order_relaxed) == 0)
+  {
+    return nullptr;
+  }
+  // Tasks may switch while an arena is open, so the arena is looked up for the running task
+  jl_value_t* task = (jl_value_t*)jl_current_task;
+  std::lock_guard<std::mutex> lock(open_arenas_mutex());
+  const std::vector<Arena*>& arenas = open_arenas();
+  for(auto it = arenas.rbegin(); it != arenas.rend(); ++it)
+  {
+    if((*it)->m_task->value == task)
+    {
+      return *it;
+    }
+  }
+  return nullptr;
+}
+
+namespace detail
+{
+
+CXX_WRAP_EXPORT jl_value_t* schedule_async_call(AsyncCallBase* call)
+{
+  jl_function_t* async_call = jl_get_function(g_cxx_wrap_module, "_async_call");
+  if(async_call == nullptr)
+  {
+    delete call;
+    throw std::runtime_error("CxxWrap._async_call was not found");
+  }
+  jl_value_t* boxed_call = jl_box_voidpointer(static_cast<void*>(call));
+  JL_GC_PUSH1(&boxed_call);
+  jl_value_t* task = jl_call1(async_call, boxed_call);
+  JL_GC_POP();
+  if(task == nullptr)
+  {
+    delete call;
+    throw std::runtime_error("Error scheduling asynchronous call");
+  }
+  return task;
+}
+
 }
 
 Module::Module(const std::string& name) : m_name(name)
@@ -50,21 +580,101 @@ Module& ModuleRegistry::create_module(const std::string &name)
 
   Module* mod = new Module(name);
   m_modules[name].reset(mod);
+  // Types looked up before may be shadowed by the types of the new module
+  detail::invalidate_type_cache();
   return *mod;
 }
 
+namespace
+{
+
+// Key for the julia_type cache: the current module, which is one of the searched modules, and the interned symbols for the type and module name
+struct TypeCacheKey
+{
+  jl_module_t* current_module;
+  jl_sym_t* name;
+  jl_sym_t* module_name;
+
+  bool operator==(const TypeCacheKey& other) const
+  {
+    return current_module == other.current_module && name == other.name && module_name == other.module_name;
+  }
+};
+
+struct TypeCacheKeyHash
+{
+  std::size_t operator()(const TypeCacheKey& key) const
+  {
+    const std::hash<const void*> h;
+    return h(key.current_module) ^ (h(key.name) * 31) ^ (h(key.module_name) * 961);
+  }
+};
+
+std::unordered_map<TypeCacheKey, jl_datatype_t*, TypeCacheKeyHash>& type_cache()
+{
+  static std::unordered_map<TypeCacheKey, jl_datatype_t*, TypeCacheKeyHash> m_cache;
+  return m_cache;
+}
+
+/// Guards type_cache(). Julia is never called with the lock held, since the lookup may allocate.
+std::mutex& type_cache_mutex()
+{
+  static std::mutex m_mutex;
+  return m_mutex;
+}
+
+std::atomic<std::size_t>& type_cache_generation_counter()
+{
+  static std::atomic<std::size_t> m_generation(0);
+  return m_generation;
+}
+
+}
+
+namespace detail
+{
+
+CXX_WRAP_EXPORT std::size_t type_cache_generation()
+{
+  return type_cache_generation_counter().load(std::memory_order_acquire);
+}
+
+CXX_WRAP_EXPORT void invalidate_type_cache()
+{
+  std::lock_guard<std::mutex> lock(type_cache_mutex());
+  type_cache().clear();
+  type_cache_generation_counter().fetch_add(1, std::memory_order_acq_rel);
+}
+
+}
+
 CXX_WRAP_EXPORT jl_datatype_t* julia_type(const std::string& name, const std::string& module_name)
 {
-  for(jl_module_t* mod : {jl_base_module, g_cxx_wrap_module, jl_current_module, module_name.empty() ? nullptr : (jl_module_t*)jl_get_global(jl_current_module, jl_symbol(module_name.c_str()))})
+  // Symbols are interned, so they identify the names without copying them
+  jl_sym_t* name_sym = jl_symbol(name.c_str());
+  jl_sym_t* module_sym = module_name.empty() ? nullptr : jl_symbol(module_name.c_str());
+  const TypeCacheKey key = {jl_current_module, name_sym, module_sym};
+  {
+    std::lock_guard<std::mutex> lock(type_cache_mutex());
+    const auto cached = type_cache().find(key);
+    if(cached != type_cache().end())
+    {
+      return cached->second;
+    }
+  }
+
+  for(jl_module_t* mod : {jl_base_module, g_cxx_wrap_module, jl_current_module, module_sym == nullptr ? nullptr : (jl_module_t*)jl_get_global(jl_current_module, module_sym)})
   {
     if(mod == nullptr)
     {
       continue;
     }
 
-    jl_value_t* gval = jl_get_global(mod, jl_symbol(name.c_str()));
+    jl_value_t* gval = jl_get_global(mod, name_sym);
     if(gval != nullptr && jl_is_datatype(gval))
     {
+      std::lock_guard<std::mutex> lock(type_cache_mutex());
+      type_cache()[key] = (jl_datatype_t*)gval;
       return (jl_datatype_t*)gval;
     }
   }
@@ -1,16 +1,21 @@
 #ifndef CXX_WRAP_HPP
 #define CXX_WRAP_HPP
 
+#include <atomic>
 #include <cassert>
 #include <functional>
 #include <map>
 #include <memory>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <typeinfo>
 #include <typeindex>
+#include <type_traits>
 #include <vector>
 
 #include "array.hpp"
+#include "instrumentation.hpp"
 #include "type_conversion.hpp"
 
 namespace cxx_wrap
@@ -24,11 +29,10 @@ namespace detail
 template<typename R, typename... Args>
 struct ReturnTypeAdapter
 {
-  inline mapped_julia_type<remove_const_ref<R>> operator()(const void* functor, mapped_julia_type<mapped_reference_type<Args>>... args)
+  template<typename FunctorT>
+  inline mapped_julia_type<remove_const_ref<R>> operator()(const FunctorT& functor, mapped_julia_type<mapped_reference_type<Args>>... args)
   {
-    auto std_func = reinterpret_cast<const std::function<R(Args...)>*>(functor);
-    assert(std_func != nullptr);
-    return convert_to_julia((*std_func)(convert_to_cpp<mapped_reference_type<Args>>(args)...));
+    return convert_to_julia(functor(convert_to_cpp<mapped_reference_type<Args>>(args)...));
   }
 };
 
@@ -36,11 +40,10 @@ struct ReturnTypeAdapter
 template<typename R, typename... Args>
 struct ReturnTypeAdapter<R&, Args...>
 {
-  inline mapped_julia_type<remove_const_ref<R>> operator()(const void* functor, mapped_julia_type<mapped_reference_type<Args>>... args)
+  template<typename FunctorT>
+  inline mapped_julia_type<remove_const_ref<R>> operator()(const FunctorT& functor, mapped_julia_type<mapped_reference_type<Args>>... args)
   {
-    auto std_func = reinterpret_cast<const std::function<R&(Args...)>*>(functor);
-    assert(std_func != nullptr);
-    R& result = (*std_func)(convert_to_cpp<mapped_reference_type<Args>>(args)...);
+    R& result = functor(convert_to_cpp<mapped_reference_type<Args>>(args)...);
     return convert_to_julia(&result);
   }
 };
@@ -48,11 +51,10 @@ struct ReturnTypeAdapter<R&, Args...>
 template<typename... Args>
 struct ReturnTypeAdapter<void, Args...>
 {
-  inline void operator()(const void* functor, mapped_julia_type<mapped_reference_type<Args>>... args)
+  template<typename FunctorT>
+  inline void operator()(const FunctorT& functor, mapped_julia_type<mapped_reference_type<Args>>... args)
   {
-    auto std_func = reinterpret_cast<const std::function<void(Args...)>*>(functor);
-    assert(std_func != nullptr);
-    (*std_func)(convert_to_cpp<mapped_reference_type<Args>>(args)...);
+    functor(convert_to_cpp<mapped_reference_type<Args>>(args)...);
   }
 };
 
@@ -62,7 +64,97 @@ mapped_julia_type<remove_const_ref<R>> call_functor(const void* functor, mapped_
 {
   try
   {
-    return ReturnTypeAdapter<R, Args...>()(functor, args...);
+    auto std_func = reinterpret_cast<const std::function<R(Args...)>*>(functor);
+    assert(std_func != nullptr);
+    return ReturnTypeAdapter<R, Args...>()(*std_func, args...);
+  }
+  catch(const std::runtime_error& err)
+  {
+    jl_error(err.what());
+  }
+
+  return mapped_julia_type<remove_const_ref<R>>();
+}
+
+/// Thunk for the functions of instrumented modules
+template<typename R, typename... Args>
+struct InstrumentedFunctor
+{
+  std::function<R(Args...)> function;
+  std::size_t id;
+};
+
+/// Call a std::function, recording the call in the statistics of the function
+template<typename R, typename... Args>
+mapped_julia_type<remove_const_ref<R>> call_instrumented_functor(const void* thunk, mapped_julia_type<remove_const_ref<Args>>... args)
+{
+  try
+  {
+    auto data = reinterpret_cast<const InstrumentedFunctor<R, Args...>*>(thunk);
+    assert(data != nullptr);
+    CallTimer timer(data->id);
+    try
+    {
+      return ReturnTypeAdapter<R, Args...>()(data->function, args...);
+    }
+    catch(...)
+    {
+      timer.exception();
+      throw;
+    }
+  }
+  catch(const std::runtime_error& err)
+  {
+    jl_error(err.what());
+  }
+
+  return mapped_julia_type<remove_const_ref<R>>();
+}
+
+/// Storage for a functor whose type alone identifies it (capture-less lambda or compile-time member function pointer)
+template<typename FunctorT>
+struct StaticFunctor
+{
+  static_assert(std::is_empty<FunctorT>::value, "Only stateless functors can be called without a thunk");
+
+  static void set(const FunctorT& f)
+  {
+    if(!is_set())
+    {
+      new (&storage()) FunctorT(f);
+      is_set() = true;
+    }
+  }
+
+  static const FunctorT& get()
+  {
+    assert(is_set());
+    return *reinterpret_cast<const FunctorT*>(&storage());
+  }
+
+private:
+  typedef typename std::aligned_storage<sizeof(FunctorT), alignof(FunctorT)>::type storage_t;
+
+  static storage_t& storage()
+  {
+    static storage_t m_storage;
+    return m_storage;
+  }
+
+  static bool& is_set()
+  {
+    static bool m_is_set = false;
+    return m_is_set;
+  }
+};
+
+/// Call a stateless functor directly, so no thunk has to be passed from Julia
+template<typename FunctorT, typename R, typename... Args>
+mapped_julia_type<remove_const_ref<R>> call_static_functor(mapped_julia_type<remove_const_ref<Args>>... args)
+{
+  try
+  {
+    return ReturnTypeAdapter<R, Args...>()(StaticFunctor<FunctorT>::get(), args...);
   }
   catch(const std::runtime_error& err)
   {
@@ -72,6 +164,35 @@ mapped_julia_type<remove_const_ref<R>> call_functor(const void* functor, mapped_
   return mapped_julia_type<remove_const_ref<R>>();
 }
 
+/// Call a member function that is known at compile time
+template<typename T, typename MemberFnT, MemberFnT F>
+struct MemberFunctor;
+
+template<typename T, typename R, typename CT, typename... ArgsT, R(CT::*F)(ArgsT...)>
+struct MemberFunctor<T, R(CT::*)(ArgsT...), F>
+{
+  R operator()(T& obj, ArgsT... args) const
+  {
+    return (obj.*F)(args...);
+  }
+};
+
+template<typename T, typename R, typename CT, typename... ArgsT, R(CT::*F)(ArgsT...) const>
+struct MemberFunctor<T, R(CT::*)(ArgsT...) const, F>
+{
+  R operator()(const T& obj, ArgsT... args) const
+  {
+    return (obj.*F)(args...);
+  }
+};
+
+/// True if the lambda has no captures, i.e. it can be reconstructed from its type alone
+template<typename LambdaT, typename R, typename... ArgsT>
+struct IsStatelessLambda
+{
+  static constexpr bool value = std::is_empty<LambdaT>::value && std::is_convertible<LambdaT, R(*)(ArgsT...)>::value;
+};
+
 /// Make a vector with the types in the variadic template parameter pack
 template<typename... Args>
 std::vector<jl_datatype_t*> typeid_vector()
@@ -104,6 +225,54 @@ struct NeedConvertHelper<>
 
 } // end namespace detail
 
+/// Owner of the C++ objects that are created using create while it is open.
+/// The objects don't get a finalizer and are all deleted at once when the arena is closed.
+class CXX_WRAP_EXPORT Arena
+{
+public:
+  typedef void (*finalizer_t)(jl_value_t*);
+
+  /// Open a new arena, making it the current arena of the calling task
+  Arena();
+  ~Arena();
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /// Take ownership of the C++ object wrapped by the given Julia value. gc_finalizer is attached instead if the arena is released.
+  void adopt(jl_value_t* wrapper, finalizer_t finalizer, jl_function_t* gc_finalizer);
+
+  /// Delete all owned objects in the reverse order of creation. Julia values still referring to them are set to null.
+  void close();
+
+  /// Close the arena without deleting the owned objects, which get their normal finalizer instead
+  void release();
+
+  /// Number of objects owned by the arena
+  std::size_t size() const
+  {
+    return m_finalizers.size();
+  }
+
+  bool is_open() const
+  {
+    return m_wrappers != nullptr;
+  }
+
+  /// The most recently opened arena of the calling task that is still open, or nullptr if there is none
+  static Arena* current();
+
+private:
+  /// Remove the arena from the open arenas
+  void unregister();
+
+  jl_array_t* m_wrappers;
+  /// Weak reference to the task that opened the arena, cleared when the task is collected so its address can't match a new task
+  jl_weakref_t* m_task;
+  std::vector<finalizer_t> m_finalizers;
+  std::vector<jl_function_t*> m_gc_finalizers;
+};
+
 template<bool>
 struct CreateChooser
 {};
@@ -114,15 +283,44 @@ struct CreateChooser<false>
 {
   template<typename T, typename... ArgsT>
   static jl_value_t* create(SingletonType<T>, ArgsT&&... args)
+  {
+    return create_internal<T>(IsInline<T>(), std::forward<ArgsT>(args)...);
+  }
+
+private:
+  // Object stored inline in the Julia object, no finalizer needed
+  template<typename T, typename... ArgsT>
+  static jl_value_t* create_internal(std::true_type, ArgsT&&... args)
+  {
+    jl_datatype_t* dt = static_type_mapping<T>::julia_type();
+    assert(!jl_isbits(dt));
+    return detail::new_inline<T>(dt, std::forward<ArgsT>(args)...);
+  }
+
+  template<typename T, typename... ArgsT>
+  static jl_value_t* create_internal(std::false_type, ArgsT&&... args)
   {
     jl_datatype_t* dt = static_type_mapping<T>::julia_type();
     assert(!jl_isbits(dt));
 
-    T* cpp_obj = new T(std::forward<ArgsT>(args)...);
+    T* cpp_obj = detail::NewObject<T>()(std::forward<ArgsT>(args)...);
+    // Counted before the wrapper is allocated, since this may run a collection
+    if(!std::is_base_of<detail::UnsizedObject, SizeOf<T>>::value)
+    {
+      detail::add_external_memory(cpp_obj, SizeOf<T>::bytes(*cpp_obj));
+    }
 
     jl_value_t* result = convert_to_julia(cpp_obj);
     JL_GC_PUSH1(&result);
-    jl_gc_add_finalizer(result, static_type_mapping<T>::finalizer());
+    Arena* arena = Arena::current();
+    if(arena != nullptr)
+    {
+      arena->adopt(result, detail::finalizer<T>, static_type_mapping<T>::finalizer());
+    }
+    else
+    {
+      jl_gc_add_finalizer(result, static_type_mapping<T>::finalizer());
+    }
     JL_GC_POP();
 
     assert(convert_to_cpp<T*>(result) == cpp_obj);
@@ -150,6 +348,14 @@ typename static_type_mapping<T>::type create(ArgsT&&... args)
   return CreateChooser<IsImmutable<T>::value>::create(SingletonType<T>(), std::forward<ArgsT>(args)...);
 }
 
+template<> struct IsImmutable<PoolStats> : std::true_type {};
+
+template<> struct static_type_mapping<PoolStats>
+{
+  typedef jl_value_t* type;
+  static jl_datatype_t* julia_type() { return detail::cached_julia_type([]() { return cxx_wrap::julia_type("PoolStats"); }); }
+};
+
 // The CxxWrap Julia module
 extern jl_module_t* g_cxx_wrap_module;
 extern jl_datatype_t* g_cppfunctioninfo_type;
@@ -170,6 +376,9 @@ public:
   /// Return type
   virtual jl_datatype_t* return_type() const = 0;
 
+  /// Called when the function is bound to a method in Julia. Instrumented functions register their call statistics here, once the name is final.
+  virtual void bind(const std::string& /*module_name*/) {}
+
   virtual ~FunctionWrapperBase() {}
 
   inline void set_name(jl_value_t* name)
@@ -222,6 +431,48 @@ private:
   functor_t m_function;
 };
 
+/// Implementation of function storage for instrumented modules, keeping call statistics
+template<typename R, typename... Args>
+class InstrumentedFunctionWrapper : public FunctionWrapperBase
+{
+public:
+  typedef std::function<R(Args...)> functor_t;
+
+  InstrumentedFunctionWrapper(const functor_t& function)
+  {
+    m_functor.function = function;
+    m_functor.id = 0;
+  }
+
+  virtual void bind(const std::string& module_name)
+  {
+    m_functor.id = detail::register_instrumented_function(module_name, this);
+  }
+
+  virtual void* pointer()
+  {
+    return reinterpret_cast<void*>(detail::call_instrumented_functor<R, Args...>);
+  }
+
+  virtual void* thunk()
+  {
+    return reinterpret_cast<void*>(&m_functor);
+  }
+
+  virtual std::vector<jl_datatype_t*> argument_types() const
+  {
+    return detail::typeid_vector<Args...>();
+  }
+
+  virtual jl_datatype_t* return_type() const
+  {
+    return static_type_mapping<remove_const_ref<R>>::julia_type();
+  }
+
+private:
+  detail::InstrumentedFunctor<R, Args...> m_functor;
+};
+
 /// Implementation of function storage, case of a function pointer
 template<typename R, typename... Args>
 class FunctionPtrWrapper : public FunctionWrapperBase
@@ -257,6 +508,43 @@ private:
   R(*m_function)(Args...);
 };
 
+/// Implementation of function storage, case of a stateless functor called through a dedicated trampoline
+template<typename FunctorT, typename R, typename... Args>
+class StaticFunctionWrapper : public FunctionWrapperBase
+{
+public:
+  StaticFunctionWrapper(const FunctorT& f)
+  {
+    detail::StaticFunctor<FunctorT>::set(f);
+  }
+
+  virtual void* pointer()
+  {
+    return reinterpret_cast<void*>(detail::call_static_functor<FunctorT, R, Args...>);
+  }
+
+  virtual void* thunk()
+  {
+    return nullptr;
+  }
+
+  virtual std::vector<jl_datatype_t*> argument_types() const
+  {
+    return detail::typeid_vector<Args...>();
+  }
+
+  virtual jl_datatype_t* return_type() const
+  {
+    return static_type_mapping<remove_const_ref<R>>::julia_type();
+  }
+};
+
+/// Member function pointer that is known at compile time, see CXX_WRAP_MEMBER
+template<typename MemberFnT, MemberFnT F>
+struct MemberFunction
+{
+};
+
 /// Encapsulate a list of fields, for the field list of a Julia composite type
 template<typename... TypesT>
 struct FieldList
@@ -293,12 +581,161 @@ struct InstantiateParametricType
   }
 };
 
+template<typename T, int N>
+struct InstantiateParametricType<ArrayView<T,N>>
+{
+  int operator()(Module&) const
+  {
+    if(!static_type_mapping<ArrayView<T,N>>::has_julia_type())
+    {
+      // StridedView{T,N} is parametrized on N as an Int, not the int used here
+      jl_value_t* boxed_n = jl_box_long(N);
+      JL_GC_PUSH1(&boxed_n);
+      jl_datatype_t* dt = (jl_datatype_t*)jl_apply_type((jl_value_t*)julia_type("StridedView"), jl_svec2(julia_type<T>(), boxed_n));
+      protect_from_gc(dt);
+      set_julia_type<ArrayView<T,N>>(dt);
+      JL_GC_POP();
+    }
+    return 0;
+  }
+};
+
+template<typename T>
+struct InstantiateParametricType<Moved<T>>
+{
+  int operator()(Module&) const
+  {
+    if(!static_type_mapping<Moved<T>>::has_julia_type())
+    {
+      jl_datatype_t* dt = (jl_datatype_t*)jl_apply_type((jl_value_t*)julia_type("Moved"), jl_svec1(julia_type<T>()));
+      protect_from_gc(dt);
+      set_julia_type<Moved<T>>(dt);
+    }
+    return 0;
+  }
+};
+
 template<typename... TypesT>
 void instantiate_parametric_types(Module& m)
 {
   auto unused = {InstantiateParametricType<remove_const_ref<TypesT>>()(m)...};
 }
 
+namespace detail
+{
+
+/// A call made through a function added with Module::async_method. It runs on a worker thread, the result is converted on the Julia thread.
+class CXX_WRAP_EXPORT AsyncCallBase
+{
+public:
+  virtual ~AsyncCallBase() {}
+
+  /// Run the call, recording any exception. Called on a worker thread.
+  void run()
+  {
+    try
+    {
+      execute();
+    }
+    catch(const std::exception& err)
+    {
+      m_error = err.what();
+      m_failed = true;
+    }
+    catch(...)
+    {
+      m_error = "Unknown exception in asynchronous call";
+      m_failed = true;
+    }
+    m_done.store(true, std::memory_order_release);
+  }
+
+  /// The result converted to Julia, after run finished
+  jl_value_t* result()
+  {
+    if(!m_done.load(std::memory_order_acquire))
+    {
+      throw std::runtime_error("Asynchronous call was not finished");
+    }
+    if(m_failed)
+    {
+      throw std::runtime_error(m_error);
+    }
+    return convert_result();
+  }
+
+protected:
+  virtual void execute() = 0;
+  virtual jl_value_t* convert_result() = 0;
+
+private:
+  std::atomic<bool> m_done{false};
+  bool m_failed = false;
+  std::string m_error;
+};
+
+template<typename R>
+class AsyncCall : public AsyncCallBase
+{
+public:
+  AsyncCall(std::function<R()> f) : m_f(std::move(f))
+  {
+  }
+
+protected:
+  void execute()
+  {
+    m_result.reset(new R(m_f()));
+  }
+
+  jl_value_t* convert_result()
+  {
+    return box(*m_result);
+  }
+
+private:
+  std::function<R()> m_f;
+  std::unique_ptr<R> m_result;
+};
+
+template<>
+class AsyncCall<void> : public AsyncCallBase
+{
+public:
+  AsyncCall(std::function<void()> f) : m_f(std::move(f))
+  {
+  }
+
+protected:
+  void execute()
+  {
+    m_f();
+  }
+
+  jl_value_t* convert_result()
+  {
+    return jl_nothing;
+  }
+
+private:
+  std::function<void()> m_f;
+};
+
+/// Loop of a function added with Module::vectorized_method, with the functor type known so its body can be inlined
+template<typename FunctorT, typename R, typename... ArgsT>
+inline void vectorized_loop(const FunctorT& f, const std::size_t n, R* out, const ArgsT*... in)
+{
+  for(std::size_t i = 0; i != n; ++i)
+  {
+    out[i] = f(in[i]...);
+  }
+}
+
+/// Start the call on the shared thread pool through CxxWrap._async_call, returning the Julia Task that finishes it. Takes ownership of call.
+CXX_WRAP_EXPORT jl_value_t* schedule_async_call(AsyncCallBase* call);
+
+}
+
 /// Store all exposed C++ functions associated with a module
 class CXX_WRAP_EXPORT Module
 {
@@ -317,7 +754,7 @@ public:
   FunctionWrapperBase& method(const std::string& name,  std::function<R(Args...)> f)
   {
     instantiate_parametric_types<R, Args...>(*this);
-    auto* new_wrapper = new FunctionWrapper<R, Args...>(f);
+    FunctionWrapperBase* new_wrapper = m_instrumented ? static_cast<FunctionWrapperBase*>(new InstrumentedFunctionWrapper<R, Args...>(f)) : new FunctionWrapper<R, Args...>(f);
     new_wrapper->set_name((jl_value_t*)jl_symbol(name.c_str()));
     append_function(new_wrapper);
     return *new_wrapper;
@@ -330,7 +767,7 @@ public:
     bool need_convert = force_convert || !std::is_same<mapped_julia_type<R>,remove_const_ref<R>>::value || detail::NeedConvertHelper<Args...>()();
 
     // Conversion is automatic when using the std::function calling method, so if we need conversion we use that
-    if(need_convert)
+    if(need_convert || m_instrumented)
     {
       return method(name, std::function<R(Args...)>(f));
     }
@@ -351,6 +788,51 @@ public:
     return add_lambda(name, lambda, &LambdaT::operator());
   }
 
+  /// Define a new function from a stateless functor, called without any thunk
+  template<typename R, typename... Args, typename FunctorT>
+  FunctionWrapperBase& static_method(const std::string& name, const FunctorT& f)
+  {
+    if(m_instrumented)
+    {
+      return method(name, std::function<R(Args...)>(f));
+    }
+    instantiate_parametric_types<R, Args...>(*this);
+    auto* new_wrapper = new StaticFunctionWrapper<FunctorT, R, Args...>(f);
+    new_wrapper->set_name((jl_value_t*)jl_symbol(name.c_str()));
+    append_function(new_wrapper);
+    return *new_wrapper;
+  }
+
+  /// Define a function whose body runs on the shared thread pool, so Julia keeps running other tasks.
+  /// The function returns a Task and wait(task) gives the result. The arguments are copied, and wrapped objects
+  /// passed by pointer must be kept alive by the caller until the task is done. The body must not call into Julia.
+  template<typename LambdaT>
+  FunctionWrapperBase& async_method(const std::string& name, LambdaT&& lambda)
+  {
+    return add_async_lambda(name, std::forward<LambdaT>(lambda), &std::decay<LambdaT>::type::operator());
+  }
+
+  /// Define a function on bits types, together with an overload name(out, in...) taking arrays that loops in C++,
+  /// so the body of a lambda is inlined and can be vectorized. Broadcasting the function in Julia calls the array overload.
+  template<typename LambdaT>
+  FunctionWrapperBase& vectorized_method(const std::string& name, LambdaT&& lambda)
+  {
+    return add_vectorized_lambda(name, std::forward<LambdaT>(lambda), &std::decay<LambdaT>::type::operator());
+  }
+
+  /// Vectorized function from a function pointer. The loop calls through the pointer, so prefer a lambda for inlining.
+  template<typename R, typename... ArgsT>
+  FunctionWrapperBase& vectorized_method(const std::string& name, R(*f)(ArgsT...))
+  {
+    return add_vectorized<R, ArgsT...>(name, f);
+  }
+
+  /// Names of the functions added with vectorized_method
+  const std::vector<std::string>& vectorized_functions() const
+  {
+    return m_vectorized_functions;
+  }
+
   /// Loop over the functions
   template<typename F>
   void for_each_function(const F f) const
@@ -392,6 +874,17 @@ public:
     return m_name;
   }
 
+  /// Record call statistics for the functions added from now on, see CxxWrap.function_stats. Calls get the overhead of a std::function and a timer.
+  void set_instrumented(const bool instrumented)
+  {
+    m_instrumented = instrumented;
+  }
+
+  bool is_instrumented() const
+  {
+    return m_instrumented;
+  }
+
   void bind_constants(jl_module_t* mod)
   {
     for(auto& dt_pair : m_jl_constants)
@@ -412,6 +905,19 @@ public:
     return m_exported_symbols;
   }
 
+  /// True if the module adds any types, which are created again each time the library is loaded
+  bool has_types() const
+  {
+    for(const auto& dt_pair : m_jl_constants)
+    {
+      if(jl_is_datatype(dt_pair.second))
+      {
+        return true;
+      }
+    }
+    return false;
+  }
+
   jl_datatype_t* get_julia_type(const char* name)
   {
     if(m_jl_constants.count(name) != 0 && jl_is_datatype(m_jl_constants[name]))
@@ -451,18 +957,88 @@ private:
     });
   }
 
+  template<typename T>
+  void add_pool_stats(std::true_type)
+  {
+    method("pool_stats", [](SingletonType<T>) { return ObjectPool<T>::instance().stats(); });
+  }
+
+  template<typename T>
+  void add_pool_stats(std::false_type)
+  {
+  }
+
   template<typename T, bool AddBits, typename FieldListT=FieldList<>>
   TypeWrapper<T> add_type_internal(const std::string& name, jl_datatype_t* super, int abstract, FieldListT&& = FieldList<>());
 
   template<typename R, typename LambdaRefT, typename LambdaT, typename... ArgsT>
   FunctionWrapperBase& add_lambda(const std::string& name, LambdaRefT&& lambda, R(LambdaT::*f)(ArgsT...) const)
+  {
+    return add_lambda<R, ArgsT...>(name, lambda, std::integral_constant<bool, detail::IsStatelessLambda<LambdaT, R, ArgsT...>::value>());
+  }
+
+  // Lambda without captures: call it without going through std::function
+  template<typename R, typename... ArgsT, typename LambdaT>
+  FunctionWrapperBase& add_lambda(const std::string& name, const LambdaT& lambda, std::true_type)
+  {
+    return static_method<R, ArgsT...>(name, lambda);
+  }
+
+  template<typename R, typename... ArgsT, typename LambdaT>
+  FunctionWrapperBase& add_lambda(const std::string& name, const LambdaT& lambda, std::false_type)
   {
     return method(name, std::function<R(ArgsT...)>(lambda));
   }
 
+  template<typename LambdaT, typename R, typename ClassT, typename... ArgsT>
+  FunctionWrapperBase& add_async_lambda(const std::string& name, LambdaT&& lambda, R(ClassT::*)(ArgsT...) const)
+  {
+    static_assert(!std::is_reference<R>::value, "async_method functions must return by value");
+    typedef typename std::decay<LambdaT>::type functor_t;
+    instantiate_parametric_types<R>(*this);
+    functor_t f(std::forward<LambdaT>(lambda));
+    return method(name, std::function<jl_value_t*(ArgsT...)>([f](ArgsT... args)
+    {
+      return detail::schedule_async_call(new detail::AsyncCall<R>(std::bind(f, typename std::decay<ArgsT>::type(args)...)));
+    }));
+  }
+
+  template<typename LambdaT, typename R, typename ClassT, typename... ArgsT>
+  FunctionWrapperBase& add_vectorized_lambda(const std::string& name, LambdaT&& lambda, R(ClassT::*)(ArgsT...) const)
+  {
+    return add_vectorized<R, ArgsT...>(name, typename std::decay<LambdaT>::type(std::forward<LambdaT>(lambda)));
+  }
+
+  template<typename R, typename... ArgsT, typename FunctorT>
+  FunctionWrapperBase& add_vectorized(const std::string& name, const FunctorT& f)
+  {
+    static_assert(sizeof...(ArgsT) != 0 && !std::is_void<R>::value && detail::AllUnboxed<R, ArgsT...>::value, "vectorized_method requires a function of bits types with arguments and a return value");
+    FunctionWrapperBase& scalar = method(name, std::function<R(ArgsT...)>(f));
+    method(name, std::function<void(ArrayRef<R>, ArrayRef<remove_const_ref<ArgsT>>...)>([f](ArrayRef<R> out, ArrayRef<remove_const_ref<ArgsT>>... in)
+    {
+      const std::size_t n = out.size();
+      for(const std::size_t in_size : {in.size()...})
+      {
+        if(in_size != n)
+        {
+          throw std::runtime_error("Vectorized call with input of size " + std::to_string(in_size) + " for output of size " + std::to_string(n));
+        }
+      }
+      detail::vectorized_loop(f, n, out.data(), static_cast<const remove_const_ref<ArgsT>*>(in.data())...);
+    }));
+    m_vectorized_functions.push_back(name);
+    return scalar;
+  }
+
   std::string m_name;
+#ifdef CXX_WRAP_INSTRUMENT
+  bool m_instrumented = true;
+#else
+  bool m_instrumented = false;
+#endif
   std::vector<std::shared_ptr<FunctionWrapperBase>> m_functions;
   std::map<std::string, jl_value_t*> m_jl_constants;
+  std::vector<std::string> m_vectorized_functions;
   std::vector<std::string> m_exported_symbols;
 
   template<class T> friend class TypeWrapper;
@@ -472,13 +1048,8 @@ namespace detail
 {
 
 template<typename T>
-void add_smart_pointer_types(jl_datatype_t* dt, Module& mod)
+void add_smart_pointer_get(std::true_type, Module& mod)
 {
-  jl_datatype_t* sp_dt = (jl_datatype_t*)jl_apply_type(jl_get_global(get_cxxwrap_module(), jl_symbol("SharedPtr")), jl_svec1(static_type_mapping<T>::julia_type()));
-  set_julia_type<std::shared_ptr<T>>(sp_dt);
-  jl_datatype_t* up_dt = (jl_datatype_t*)jl_apply_type(jl_get_global(get_cxxwrap_module(), jl_symbol("UniquePtr")), jl_svec1(static_type_mapping<T>::julia_type()));
-  set_julia_type<std::unique_ptr<T>>(up_dt);
-
   mod.method("get", [](const std::shared_ptr<T>& ptr)
   {
     return ptr.get();
@@ -489,6 +1060,23 @@ void add_smart_pointer_types(jl_datatype_t* dt, Module& mod)
   });
 }
 
+// Inline types can't be returned by pointer, so get is not defined for them
+template<typename T>
+void add_smart_pointer_get(std::false_type, Module&)
+{
+}
+
+template<typename T>
+void add_smart_pointer_types(jl_datatype_t* dt, Module& mod)
+{
+  jl_datatype_t* sp_dt = (jl_datatype_t*)jl_apply_type(jl_get_global(get_cxxwrap_module(), jl_symbol("SharedPtr")), jl_svec1(static_type_mapping<T>::julia_type()));
+  set_julia_type<std::shared_ptr<T>>(sp_dt);
+  jl_datatype_t* up_dt = (jl_datatype_t*)jl_apply_type(jl_get_global(get_cxxwrap_module(), jl_symbol("UniquePtr")), jl_svec1(static_type_mapping<T>::julia_type()));
+  set_julia_type<std::unique_ptr<T>>(up_dt);
+
+  add_smart_pointer_get<T>(std::integral_constant<bool, !IsInline<T>::value>(), mod);
+}
+
 }
 
 template<typename T>
@@ -539,6 +1127,37 @@ struct IsParametric<T<TypeVar<I>, ParametersT...>>
   static constexpr bool value = true;
 };
 
+/// Julia type of the cpp_object field: a pointer, or the raw bytes of the object for inline types
+template<typename T, bool Inline = IsInline<T>::value>
+struct CppObjectFieldType
+{
+  jl_datatype_t* operator()() const
+  {
+    return jl_voidpointer_type;
+  }
+};
+
+template<typename T>
+struct CppObjectFieldType<T, true>
+{
+  static_assert(std::is_trivially_copyable<T>::value, "Inline types must be trivially copyable, since Julia copies them as bytes");
+  static_assert(alignof(T) <= alignof(void*), "Inline types can't have an alignment larger than a pointer");
+  static_assert(!UsePool<T>::value, "Inline types can't be allocated from a pool");
+
+  jl_datatype_t* operator()() const
+  {
+    jl_svec_t* byte_types = jl_alloc_svec(sizeof(T));
+    JL_GC_PUSH1(&byte_types);
+    for(std::size_t i = 0; i != sizeof(T); ++i)
+    {
+      jl_svecset(byte_types, i, jl_uint8_type);
+    }
+    jl_datatype_t* result = (jl_datatype_t*)jl_apply_tuple_type(byte_types);
+    JL_GC_POP();
+    return result;
+  }
+};
+
 } // namespace detail
 
 // Encapsulate a list of parameters, using types only
@@ -633,6 +1252,22 @@ public:
     return *this;
   }
 
+  /// Define a member function that is known at compile time, avoiding the std::function thunk. Use CXX_WRAP_MEMBER(&Class::function) as argument.
+  template<typename R, typename CT, typename... ArgsT, R(CT::*F)(ArgsT...)>
+  TypeWrapper<T>& method(const std::string& name, MemberFunction<R(CT::*)(ArgsT...), F>)
+  {
+    m_module.template static_method<R, T&, ArgsT...>(name, detail::MemberFunctor<T, R(CT::*)(ArgsT...), F>());
+    return *this;
+  }
+
+  /// Define a member function that is known at compile time, const version
+  template<typename R, typename CT, typename... ArgsT, R(CT::*F)(ArgsT...) const>
+  TypeWrapper<T>& method(const std::string& name, MemberFunction<R(CT::*)(ArgsT...) const, F>)
+  {
+    m_module.template static_method<R, const T&, ArgsT...>(name, detail::MemberFunctor<T, R(CT::*)(ArgsT...) const, F>());
+    return *this;
+  }
+
   /// Call operator overload
   template<typename R, typename CT, typename... ArgsT>
   TypeWrapper<T>& method(R(CT::*f)(ArgsT...))
@@ -675,6 +1310,7 @@ private:
   {
     static_assert(parameter_list<AppliedT>::nb_parameters != 0, "No parameters found when applying type. Specialize cxx_wrap::BuildParameterList for your combination of type and non-type parameters.");
     static_assert(parameter_list<AppliedT>::nb_parameters == parameter_list<T>::nb_parameters, "Parametric type applied to wrong number of parameters.");
+    static_assert(!IsInline<AppliedT>::value, "Parametric types can't be stored inline");
     jl_datatype_t* app_dt = (jl_datatype_t*)jl_apply_type((jl_value_t*)m_dt, parameter_list<AppliedT>()());
 
     set_julia_type<AppliedT>(app_dt);
@@ -700,6 +1336,8 @@ TypeWrapper<T> Module::add_type_internal(const std::string& name, jl_datatype_t*
   static_assert(((!IsImmutable<T>::value && !AddBits) || AddBits) || is_parametric, "Immutable types (marked with IsImmutable) can't be added using add_type, use add_immutable instead");
   static_assert(((std::is_trivial<T>::value && AddBits) || !AddBits) || is_parametric, "Immutable types must be trivial");
   static_assert(((IsImmutable<T>::value && AddBits) || !AddBits) || is_parametric, "Immutable types must be marked as such by specializing the IsImmutable template");
+  static_assert(!(IsInline<T>::value && AddBits), "Immutable types can't be marked with IsInline");
+  static_assert(!IsBitsImmutable<T>::value || IsImmutable<T>::value, "Types marked with IsBitsImmutable must also be marked with IsImmutable");
   if(IsBits<T>::value)
   {
     if(!jl_type_morespecific((jl_value_t*)super, (jl_value_t*)julia_type("CppBits")))
@@ -711,6 +1349,10 @@ TypeWrapper<T> Module::add_type_internal(const std::string& name, jl_datatype_t*
   {
     throw std::runtime_error("Duplicate registration of type or constant " + name);
   }
+  if(IsInline<T>::value && abstract)
+  {
+    throw std::runtime_error("Abstract type " + name + " can't be stored inline");
+  }
 
   jl_svec_t* parameters = nullptr;
   jl_svec_t* fnames = nullptr;
@@ -719,7 +1361,7 @@ TypeWrapper<T> Module::add_type_internal(const std::string& name, jl_datatype_t*
 
   parameters = is_parametric ? parameter_list<T>()() : jl_emptysvec;
   fnames = AddBits ? field_list.field_names : jl_svec1(jl_symbol("cpp_object"));
-  ftypes = AddBits ? parameter_list<FieldListT>()() : jl_svec1(jl_voidpointer_type);
+  ftypes = AddBits ? parameter_list<FieldListT>()() : jl_svec1(detail::CppObjectFieldType<T>()());
   int mutabl = !AddBits;
   int ninitialized = jl_svec_len(ftypes);
 
@@ -733,6 +1375,11 @@ TypeWrapper<T> Module::add_type_internal(const std::string& name, jl_datatype_t*
   // Create the datatype
   jl_datatype_t* dt = jl_new_datatype(jl_symbol(name.c_str()), super, parameters, fnames, ftypes, abstract, mutabl, ninitialized);
   protect_from_gc(dt);
+  if(IsBitsImmutable<T>::value && !is_parametric && !jl_isbits(dt))
+  {
+    JL_GC_POP();
+    throw std::runtime_error("Immutable " + name + " is marked with IsBitsImmutable, but has fields that are not bits types");
+  }
 
   if(abstract)
   {
@@ -753,6 +1400,7 @@ TypeWrapper<T> Module::add_type_internal(const std::string& name, jl_datatype_t*
         add_copy_constructor<T>(std::is_copy_constructible<T>(), dt);
         detail::add_smart_pointer_types<T>(dt, *this);
       }
+      add_pool_stats<T>(UsePool<T>());
     }
   }
 
@@ -913,4 +1561,7 @@ extern "C" CXX_WRAP_EXPORT void register_julia_modules(void* void_reg) { \
 
 #define JULIA_CPP_MODULE_END }
 
+/// Pass a member function pointer as a compile-time constant, e.g. wrapped.method("greet", CXX_WRAP_MEMBER(&World::greet))
+#define CXX_WRAP_MEMBER(f) cxx_wrap::MemberFunction<decltype(f), f>()
+
 #endif
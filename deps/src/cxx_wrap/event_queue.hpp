@@ -0,0 +1,153 @@
+#ifndef CXX_WRAP_EVENT_QUEUE_HPP
+#define CXX_WRAP_EVENT_QUEUE_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "array.hpp"
+
+// Declared here to avoid depending on the libuv headers, the function is exported by libjulia
+struct uv_async_s;
+extern "C" int uv_async_send(uv_async_s* handle);
+
+namespace cxx_wrap
+{
+
+namespace detail
+{
+
+/// Part of EventQueue that doesn't depend on the event type, used by the Julia drainer through c_interface.cpp
+class EventQueueBase
+{
+public:
+  virtual ~EventQueueBase() {}
+
+  /// Set the libuv async handle that is signaled when events arrive, or nullptr to stop signaling
+  void attach(uv_async_s* handle)
+  {
+    std::lock_guard<std::mutex> lock(m_handle_mutex);
+    m_handle = handle;
+  }
+
+  /// Stop the drainer once the remaining events are taken. Can be called from any thread.
+  void close()
+  {
+    m_closed.store(true);
+    wake();
+  }
+
+  bool is_closed() const
+  {
+    return m_closed.load();
+  }
+
+  virtual bool empty() const = 0;
+
+  /// Julia array with the events posted so far, in posting order. Called on the Julia thread.
+  virtual jl_value_t* take_batch() = 0;
+
+protected:
+  /// Signal the drainer. Only called when an event arrives in an empty queue, so once per batch.
+  void wake()
+  {
+    std::lock_guard<std::mutex> lock(m_handle_mutex);
+    if(m_handle != nullptr)
+    {
+      uv_async_send(m_handle);
+    }
+  }
+
+private:
+  std::mutex m_handle_mutex;
+  uv_async_s* m_handle = nullptr;
+  std::atomic<bool> m_closed{false};
+};
+
+}
+
+/// Queue for events posted from any thread, including threads not managed by Julia, and handled in batches by a Julia task.
+/// Posting doesn't lock and doesn't call Julia. T must be convertible to Julia, preferably as a bits type.
+/// The queue must outlive the drainer started with CxxWrap.drain_events.
+template<typename T>
+class EventQueue : public detail::EventQueueBase
+{
+public:
+  ~EventQueue()
+  {
+    Node* node = m_head.exchange(nullptr);
+    while(node != nullptr)
+    {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  /// Add an event, waking the drainer if it was idle
+  void post(T event)
+  {
+    Node* node = new Node{std::move(event), nullptr};
+    Node* head = m_head.load(std::memory_order_relaxed);
+    do
+    {
+      node->next = head;
+    } while(!m_head.compare_exchange_weak(head, node, std::memory_order_release, std::memory_order_relaxed));
+    // The node may already be taken by the drainer, so only the local copy of the old head is used
+    if(head == nullptr)
+    {
+      wake();
+    }
+  }
+
+  /// Remove all queued events, in posting order
+  std::vector<T> take_all()
+  {
+    Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+    std::vector<T> result;
+    for(Node* n = node; n != nullptr; n = n->next)
+    {
+      result.push_back(std::move(n->value));
+    }
+    while(node != nullptr)
+    {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+    std::reverse(result.begin(), result.end());
+    return result;
+  }
+
+  bool empty() const
+  {
+    return m_head.load(std::memory_order_relaxed) == nullptr;
+  }
+
+  jl_value_t* take_batch()
+  {
+    return (jl_value_t*)Array<T>(take_all()).wrapped();
+  }
+
+  /// Pointer to pass to CxxWrap.drain_events
+  void* julia_handle()
+  {
+    return static_cast<void*>(static_cast<detail::EventQueueBase*>(this));
+  }
+
+private:
+  /// Events form a stack that the drainer takes as a whole, so producers only contend on the head
+  struct Node
+  {
+    T value;
+    Node* next;
+  };
+
+  std::atomic<Node*> m_head{nullptr};
+};
+
+} // namespace cxx_wrap
+
+#endif
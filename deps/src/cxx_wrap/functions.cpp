@@ -18,6 +18,7 @@ JuliaFunction::JuliaFunction(const std::string& name, const std::string& module_
   {
     throw std::runtime_error("Could not find function " + name);
   }
+  m_trace_id = detail::trace_name_id(module_name.empty() ? name : module_name + "." + name);
 }
 
 JuliaFunction::JuliaFunction(jl_function_t* fpointer)
@@ -27,6 +28,48 @@ JuliaFunction::JuliaFunction(jl_function_t* fpointer)
     throw std::runtime_error("Storing a null function pointer in a JuliaFunction is not allowed");
   }
   m_function = fpointer;
+  m_trace_id = detail::trace_name_id(julia_type_name((jl_datatype_t*)jl_typeof(fpointer)));
+}
+
+namespace detail
+{
+
+CXX_WRAP_EXPORT void* compile_cfunction(jl_function_t* f, jl_datatype_t* return_type, const std::vector<jl_datatype_t*>& argument_types)
+{
+  jl_svec_t* params = nullptr;
+  jl_value_t* argt = nullptr;
+  jl_value_t* result = nullptr;
+  JL_GC_PUSH3(&params, &argt, &result);
+  params = jl_alloc_svec(argument_types.size());
+  for(std::size_t i = 0; i != argument_types.size(); ++i)
+  {
+    jl_svecset(params, i, argument_types[i]);
+  }
+  argt = (jl_value_t*)jl_apply_tuple_type(params);
+  result = jl_call3(jl_get_function(jl_base_module, "cfunction"), (jl_value_t*)f, (jl_value_t*)return_type, argt);
+
+  void* fptr = nullptr;
+  if(jl_exception_occurred())
+  {
+    jl_exception_clear();
+  }
+  else
+  {
+    fptr = jl_unbox_voidpointer(result);
+  }
+  JL_GC_POP();
+  return fptr;
+}
+
+CXX_WRAP_EXPORT std::size_t method_table_version()
+{
+#if JULIA_VERSION_MAJOR > 0 || JULIA_VERSION_MINOR > 5
+  return jl_get_world_counter();
+#else
+  return 0;
+#endif
+}
+
 }
 
 }
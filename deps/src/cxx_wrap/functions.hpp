@@ -1,7 +1,9 @@
 #ifndef FUNCTIONS_HPP
 #define FUNCTIONS_HPP
 
+#include <algorithm>
 #include <sstream>
+#include <unordered_set>
 #include <vector>
 
 #include "array.hpp"
@@ -27,10 +29,32 @@ public:
     return m_function;
   }
 
+  /// Name id for the trace events of calls to this function
+  std::size_t trace_id() const
+  {
+    return m_trace_id;
+  }
+
   /// Call a julia function, converting the arguments to the corresponding Julia types
   template<typename... ArgumentsT>
   jl_value_t* operator()(ArgumentsT&&... args) const;
 
+  /// Call f!(out, in...) on whole arrays of bits types, so the Julia function is entered once per batch instead of once per element.
+  /// The function must write its results into out. Arrays are split into batches according to set_batch_size.
+  template<typename OutT, typename... InT>
+  void call_batched(ArrayRef<OutT> out, ArrayRef<InT>... in) const;
+
+  /// Maximum number of elements passed to each call by call_batched. 0 (the default) passes the complete arrays at once.
+  void set_batch_size(const std::size_t n)
+  {
+    m_batch_size = n;
+  }
+
+  std::size_t batch_size() const
+  {
+    return m_batch_size;
+  }
+
 private:
   struct StoreArgs
   {
@@ -57,11 +81,14 @@ private:
     int m_i = 0;
   };
   jl_function_t* m_function;
+  std::size_t m_trace_id;
+  std::size_t m_batch_size = 0;
 };
 
 template<typename... ArgumentsT>
 jl_value_t* JuliaFunction::operator()(ArgumentsT&&... args) const
 {
+  detail::TraceSpan span(detail::TraceKind::JuliaCall, m_trace_id);
   const int nb_args = sizeof...(args);
 
   jl_value_t* result = nullptr;
@@ -101,6 +128,161 @@ jl_value_t* JuliaFunction::operator()(ArgumentsT&&... args) const
   return result;
 }
 
+namespace detail
+{
+  /// Compile f for the given argument types using cfunction. Returns nullptr if this is not possible.
+  CXX_WRAP_EXPORT void* compile_cfunction(jl_function_t* f, jl_datatype_t* return_type, const std::vector<jl_datatype_t*>& argument_types);
+
+  /// Value that changes when methods are added, or always 0 if the Julia version does not keep track of this
+  CXX_WRAP_EXPORT std::size_t method_table_version();
+
+  /// Convert the result of a boxed call
+  template<typename R>
+  struct JuliaCallResult
+  {
+    R operator()(jl_value_t* result) const
+    {
+      if(result == nullptr)
+      {
+        throw std::runtime_error("Error calling Julia function");
+      }
+      if(!jl_isa(result, (jl_value_t*)julia_type<R>()))
+      {
+        throw std::runtime_error("Julia function returned a " + julia_type_name((jl_datatype_t*)jl_typeof(result)) + " instead of a " + julia_type_name(julia_type<R>()));
+      }
+      return convert_to_cpp<R>(result);
+    }
+  };
+
+  template<>
+  struct JuliaCallResult<void>
+  {
+    void operator()(jl_value_t* result) const
+    {
+      if(result == nullptr)
+      {
+        throw std::runtime_error("Error calling Julia function");
+      }
+    }
+  };
+}
+
+template<typename OutT, typename... InT>
+void JuliaFunction::call_batched(ArrayRef<OutT> out, ArrayRef<InT>... in) const
+{
+  static_assert(detail::AllUnboxed<OutT, InT...>::value, "Batched calls are only supported for arrays of bits types");
+
+  const std::size_t n = out.size();
+  for(const std::size_t in_size : std::vector<std::size_t>({in.size()...}))
+  {
+    if(in_size != n)
+    {
+      throw std::runtime_error("Batched Julia call with input of size " + std::to_string(in_size) + " for output of size " + std::to_string(n));
+    }
+  }
+
+  const std::size_t batch = (m_batch_size == 0 || m_batch_size >= n) ? n : m_batch_size;
+  if(batch == n)
+  {
+    if((*this)(out, in...) == nullptr)
+    {
+      throw std::runtime_error("Error in batched Julia function call");
+    }
+    return;
+  }
+
+  // Each batch refers to a slice of the existing data, without copying
+  const int nb_args = sizeof...(in) + 1;
+  jl_value_t** julia_args;
+  JL_GC_PUSHARGS(julia_args, nb_args);
+  detail::TraceSpan span(detail::TraceKind::JuliaCall, m_trace_id);
+  for(std::size_t begin = 0; begin < n; begin += batch)
+  {
+    const std::size_t len = std::min(batch, n - begin);
+    int i = 0;
+    julia_args[i++] = (jl_value_t*)ArrayRef<OutT>(out.data() + begin, len).wrapped();
+    int expand[] = {0, (julia_args[i++] = (jl_value_t*)ArrayRef<InT>(in.data() + begin, len).wrapped(), 0)...};
+    static_cast<void>(expand);
+    jl_call(m_function, julia_args, nb_args);
+    if(jl_exception_occurred())
+    {
+      jl_show(jl_stderr_obj(), jl_exception_occurred());
+      jl_printf(jl_stderr_stream(), "\n");
+      JL_GC_POP();
+      throw std::runtime_error("Error in batched Julia function call");
+    }
+  }
+  JL_GC_POP();
+}
+
+/// Julia function with a fixed C++ signature. For bits argument and return types, the specialized method is compiled once
+/// into a native function pointer using cfunction, so calls don't box their arguments or use dynamic dispatch.
+/// Other signatures, or functions that can't be compiled for the signature, are called through JuliaFunction.
+template<typename SignatureT>
+class TypedJuliaFunction;
+
+template<typename R, typename... ArgsT>
+class TypedJuliaFunction<R(ArgsT...)>
+{
+public:
+  /// Compiled functions take their arguments by value, since Julia has no references to bits types
+  typedef R(*fptr_t)(remove_const_ref<ArgsT>...);
+
+  /// Construct using a function name and module name, as for JuliaFunction
+  TypedJuliaFunction(const std::string& name, const std::string& module_name = "") : m_function(name, module_name)
+  {
+  }
+
+  TypedJuliaFunction(jl_function_t* fpointer) : m_function(fpointer)
+  {
+  }
+
+  R operator()(ArgsT... args) const
+  {
+    update();
+    if(m_fptr != nullptr)
+    {
+      detail::TraceSpan span(detail::TraceKind::JuliaCall, m_function.trace_id());
+      return m_fptr(args...);
+    }
+    return detail::JuliaCallResult<R>()(m_function(args...));
+  }
+
+  /// True if calls go directly through a compiled function pointer
+  bool is_compiled() const
+  {
+    update();
+    return m_fptr != nullptr;
+  }
+
+  jl_function_t* pointer() const
+  {
+    return m_function.pointer();
+  }
+
+private:
+  // Compile on first use, and again if the method table changed
+  void update() const
+  {
+    if(m_resolved && m_version == detail::method_table_version())
+    {
+      return;
+    }
+    m_version = detail::method_table_version();
+    m_resolved = true;
+    m_fptr = nullptr;
+    if(detail::AllUnboxed<R, ArgsT...>::value)
+    {
+      m_fptr = reinterpret_cast<fptr_t>(detail::compile_cfunction(m_function.pointer(), julia_type<R>(), {julia_type<remove_const_ref<ArgsT>>()...}));
+    }
+  }
+
+  JuliaFunction m_function;
+  mutable fptr_t m_fptr = nullptr;
+  mutable std::size_t m_version = 0;
+  mutable bool m_resolved = false;
+};
+
 /// Data corresponds to immutable with the same name on the Julia side
 struct SafeCFunction
 {
@@ -115,7 +297,7 @@ template<> struct IsImmutable<SafeCFunction> : std::true_type {};
 template<> struct static_type_mapping<SafeCFunction>
 {
   typedef SafeCFunction type;
-  static jl_datatype_t* julia_type() { return cxx_wrap::julia_type("SafeCFunction"); }
+  static jl_datatype_t* julia_type() { return detail::cached_julia_type([]() { return cxx_wrap::julia_type("SafeCFunction"); }); }
 };
 
 template<>
@@ -153,6 +335,14 @@ namespace detail
       return reinterpret_cast<fptr_t>(ptr);
     }
   };
+
+  /// Function pointers that already passed the type check for SignatureT on the calling thread. cfunction pointers are never freed, so entries stay valid.
+  template<typename SignatureT>
+  std::unordered_set<void*>& checked_function_pointers()
+  {
+    static thread_local std::unordered_set<void*> m_pointers;
+    return m_pointers;
+  }
 }
 
 /// Type-checking on return type and arguments of a cfunction (void* pointer)
@@ -160,6 +350,12 @@ template<typename SignatureT>
 typename detail::SplitSignature<SignatureT>::fptr_t make_function_pointer(SafeCFunction data)
 {
   typedef detail::SplitSignature<SignatureT> SplitterT;
+  std::unordered_set<void*>& checked_pointers = detail::checked_function_pointers<SignatureT>();
+  if(checked_pointers.count(data.fptr) != 0)
+  {
+    return SplitterT().cast_ptr(data.fptr);
+  }
+
   JL_GC_PUSH3(&data.fptr, &data.return_type, &data.argtypes);
 
   // Check return type
@@ -173,7 +369,7 @@ typename detail::SplitSignature<SignatureT>::fptr_t make_function_pointer(SafeCF
   // Check arguments
   const std::vector<jl_datatype_t*> expected_argstypes = SplitterT()();
   ArrayRef<jl_value_t*> argtypes(data.argtypes);
-  const int nb_args = expected_argstypes.size();
+  const std::size_t nb_args = expected_argstypes.size();
   if(nb_args != argtypes.size())
   {
     std::stringstream err_sstr;
@@ -181,7 +377,7 @@ typename detail::SplitSignature<SignatureT>::fptr_t make_function_pointer(SafeCF
     JL_GC_POP();
     throw std::runtime_error(err_sstr.str());
   }
-  for(int i = 0; i != nb_args; ++i)
+  for(std::size_t i = 0; i != nb_args; ++i)
   {
     jl_datatype_t* argt = (jl_datatype_t*)argtypes[i];
     if(argt != expected_argstypes[i])
@@ -193,6 +389,7 @@ typename detail::SplitSignature<SignatureT>::fptr_t make_function_pointer(SafeCF
     }
   }
   JL_GC_POP();
+  checked_pointers.insert(data.fptr);
   return SplitterT().cast_ptr(data.fptr);
 }
 
@@ -200,7 +397,7 @@ typename detail::SplitSignature<SignatureT>::fptr_t make_function_pointer(SafeCF
 template<typename R, typename...ArgsT> struct static_type_mapping<R(*)(ArgsT...)>
 {
   typedef SafeCFunction type;
-  static jl_datatype_t* julia_type() { return cxx_wrap::julia_type("SafeCFunction"); }
+  static jl_datatype_t* julia_type() { return detail::cached_julia_type([]() { return cxx_wrap::julia_type("SafeCFunction"); }); }
 };
 
 template<typename R, typename...ArgsT>
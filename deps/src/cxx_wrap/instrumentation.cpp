@@ -0,0 +1,370 @@
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include "cxx_wrap.hpp"
+#include "instrumentation.hpp"
+
+namespace cxx_wrap
+{
+
+namespace detail
+{
+
+namespace
+{
+
+struct InstrumentedFunction
+{
+  std::string module_name;
+  const FunctionWrapperBase* wrapper;
+};
+
+/// Counters of one thread, kept after the thread ends so its calls are still reported
+struct CounterBlock
+{
+  std::vector<std::unique_ptr<CallCounters>> counters;
+};
+
+struct InstrumentationRegistry
+{
+  std::mutex mutex;
+  std::vector<InstrumentedFunction> functions;
+  std::unordered_map<std::string, std::size_t> ids;
+  std::vector<std::unique_ptr<CounterBlock>> blocks;
+};
+
+InstrumentationRegistry& instrumentation_registry()
+{
+  static InstrumentationRegistry m_registry;
+  return m_registry;
+}
+
+void clear_counters(CallCounters& c)
+{
+  c.calls.store(0, std::memory_order_relaxed);
+  c.total_ns.store(0, std::memory_order_relaxed);
+  c.exceptions.store(0, std::memory_order_relaxed);
+  for(std::atomic<std::uint64_t>& bucket : c.histogram)
+  {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+/// Names used in trace events, indexed by id
+struct TraceNames
+{
+  std::mutex mutex;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, std::size_t> ids;
+};
+
+TraceNames& trace_names()
+{
+  static TraceNames m_names;
+  return m_names;
+}
+
+/// Slot of the trace ring buffer. sequence is odd while the event is being written and 2*(index + 1) once event number index is complete.
+struct TraceSlot
+{
+  std::atomic<std::uint64_t> sequence;
+  std::atomic<std::uint64_t> start_ns;
+  std::atomic<std::uint64_t> duration_ns;
+  std::atomic<std::uint64_t> kind_and_thread;
+  std::atomic<std::uint64_t> id;
+};
+
+static_assert((trace_buffer_size & (trace_buffer_size - 1)) == 0, "Trace buffer size must be a power of two");
+
+// Zero-initialized, so the memory is only used once events are written
+TraceSlot g_trace_slots[trace_buffer_size];
+std::atomic<std::uint64_t> g_trace_head(0);
+std::atomic<std::uint64_t> g_trace_cleared(0);
+std::atomic<std::uint64_t> g_next_trace_thread(0);
+const std::chrono::steady_clock::time_point g_trace_epoch = std::chrono::steady_clock::now();
+
+std::uint64_t trace_thread_id()
+{
+  static thread_local const std::uint64_t m_thread = g_next_trace_thread.fetch_add(1, std::memory_order_relaxed);
+  return m_thread;
+}
+
+std::uint64_t trace_ns(const std::chrono::steady_clock::time_point t)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(t - g_trace_epoch).count();
+}
+
+void write_json_string(std::ostream& out, const std::string& str)
+{
+  out << '"';
+  for(const char c : str)
+  {
+    if(c == '"' || c == '\\')
+    {
+      out << '\\' << c;
+    }
+    else if(static_cast<unsigned char>(c) < 0x20)
+    {
+      const char* hex_digits = "0123456789abcdef";
+      out << "\\u00" << hex_digits[c >> 4] << hex_digits[c & 0xf];
+    }
+    else
+    {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+/// Name of a function as shown in the statistics
+std::string function_name(const FunctionWrapperBase& wrapper)
+{
+  jl_value_t* fname = wrapper.name();
+  if(jl_is_symbol(fname))
+  {
+    return symbol_name((jl_sym_t*)fname);
+  }
+  // ConstructorFname or CallOpOverload, identified by the type they apply to
+  return julia_type_name((jl_datatype_t*)jl_typeof(fname)) + "(" + julia_type_name((jl_datatype_t*)jl_fieldref(fname, 0)) + ")";
+}
+
+/// Key identifying a function across loads of its library
+std::string function_key(const std::string& module_name, const FunctionWrapperBase& wrapper)
+{
+  std::string result = module_name + "." + function_name(wrapper);
+  for(jl_datatype_t* dt : wrapper.argument_types())
+  {
+    result += "," + julia_type_name(dt);
+  }
+  return result;
+}
+
+/// Totals for one function, copied out of the counters
+struct StatsTotals
+{
+  std::int64_t calls = 0;
+  std::int64_t total_ns = 0;
+  std::int64_t exceptions = 0;
+  std::vector<std::int64_t> histogram = std::vector<std::int64_t>(nb_latency_buckets, 0);
+};
+
+}
+
+CXX_WRAP_EXPORT std::size_t register_instrumented_function(const std::string& module_name, const FunctionWrapperBase* wrapper)
+{
+  const std::string key = function_key(module_name, *wrapper);
+  InstrumentationRegistry& registry = instrumentation_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  const auto found = registry.ids.find(key);
+  if(found != registry.ids.end())
+  {
+    registry.functions[found->second].wrapper = wrapper;
+    return found->second;
+  }
+  registry.functions.push_back(InstrumentedFunction({module_name, wrapper}));
+  registry.ids[key] = registry.functions.size() - 1;
+  return registry.functions.size() - 1;
+}
+
+CXX_WRAP_EXPORT std::atomic<bool> g_tracing_enabled(false);
+
+CXX_WRAP_EXPORT std::size_t trace_name_id(const std::string& name)
+{
+  TraceNames& names = trace_names();
+  std::lock_guard<std::mutex> lock(names.mutex);
+  const auto found = names.ids.find(name);
+  if(found != names.ids.end())
+  {
+    return found->second;
+  }
+  names.names.push_back(name);
+  names.ids[name] = names.names.size() - 1;
+  return names.names.size() - 1;
+}
+
+CXX_WRAP_EXPORT void record_trace_event(const TraceKind kind, const std::size_t id, const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end)
+{
+  const std::uint64_t index = g_trace_head.fetch_add(1, std::memory_order_relaxed);
+  TraceSlot& slot = g_trace_slots[index & (trace_buffer_size - 1)];
+  slot.sequence.store(2*index + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.start_ns.store(trace_ns(start), std::memory_order_relaxed);
+  slot.duration_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+  slot.kind_and_thread.store((trace_thread_id() << 8) | static_cast<std::uint64_t>(kind), std::memory_order_relaxed);
+  slot.id.store(id, std::memory_order_relaxed);
+  slot.sequence.store(2*index + 2, std::memory_order_release);
+}
+
+CXX_WRAP_EXPORT CallCounters& call_counters(const std::size_t id)
+{
+  static thread_local CounterBlock* block = nullptr;
+  if(block == nullptr || id >= block->counters.size())
+  {
+    InstrumentationRegistry& registry = instrumentation_registry();
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    if(block == nullptr)
+    {
+      registry.blocks.emplace_back(new CounterBlock());
+      block = registry.blocks.back().get();
+    }
+    while(block->counters.size() <= id)
+    {
+      block->counters.emplace_back(new CallCounters());
+      clear_counters(*block->counters.back());
+    }
+  }
+  return *block->counters[id];
+}
+
+}
+
+CXX_WRAP_EXPORT jl_array_t* function_stats()
+{
+  using namespace detail;
+  InstrumentationRegistry& registry = instrumentation_registry();
+
+  // Sum the counters of all threads first, so no Julia allocation happens while holding the lock
+  std::vector<InstrumentedFunction> functions;
+  std::vector<StatsTotals> totals;
+  {
+    std::lock_guard<std::mutex> lock(registry.mutex);
+    functions = registry.functions;
+    totals.resize(functions.size());
+    for(const std::unique_ptr<CounterBlock>& block : registry.blocks)
+    {
+      for(std::size_t i = 0; i != block->counters.size(); ++i)
+      {
+        const CallCounters& c = *block->counters[i];
+        totals[i].calls += c.calls.load(std::memory_order_relaxed);
+        totals[i].total_ns += c.total_ns.load(std::memory_order_relaxed);
+        totals[i].exceptions += c.exceptions.load(std::memory_order_relaxed);
+        for(int j = 0; j != nb_latency_buckets; ++j)
+        {
+          totals[i].histogram[j] += c.histogram[j].load(std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  jl_datatype_t* stats_type = julia_type("FunctionStats");
+  Array<jl_value_t*> result(stats_type);
+  jl_value_t** fields;
+  JL_GC_PUSH1(result.gc_pointer());
+  JL_GC_PUSHARGS(fields, 6);
+  for(std::size_t i = 0; i != functions.size(); ++i)
+  {
+    fields[0] = convert_to_julia(functions[i].module_name);
+    fields[1] = functions[i].wrapper->name();
+    fields[2] = box(totals[i].calls);
+    fields[3] = box(totals[i].total_ns);
+    fields[4] = box(totals[i].exceptions);
+    fields[5] = (jl_value_t*)Array<std::int64_t>(totals[i].histogram).wrapped();
+    result.push_back(jl_new_struct(stats_type, fields[0], fields[1], fields[2], fields[3], fields[4], fields[5]));
+  }
+  JL_GC_POP();
+  JL_GC_POP();
+  return result.wrapped();
+}
+
+CXX_WRAP_EXPORT void reset_function_stats()
+{
+  detail::InstrumentationRegistry& registry = detail::instrumentation_registry();
+  std::lock_guard<std::mutex> lock(registry.mutex);
+  for(const std::unique_ptr<detail::CounterBlock>& block : registry.blocks)
+  {
+    for(const std::unique_ptr<detail::CallCounters>& c : block->counters)
+    {
+      detail::clear_counters(*c);
+    }
+  }
+}
+
+CXX_WRAP_EXPORT void set_tracing(const bool enabled)
+{
+  detail::g_tracing_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+CXX_WRAP_EXPORT void clear_trace()
+{
+  detail::g_trace_cleared.store(detail::g_trace_head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+CXX_WRAP_EXPORT std::string trace_json()
+{
+  using namespace detail;
+
+  std::vector<std::string> names;
+  {
+    std::lock_guard<std::mutex> lock(trace_names().mutex);
+    names = trace_names().names;
+  }
+  std::vector<InstrumentedFunction> functions;
+  {
+    std::lock_guard<std::mutex> lock(instrumentation_registry().mutex);
+    functions = instrumentation_registry().functions;
+  }
+
+  const std::uint64_t head = g_trace_head.load(std::memory_order_acquire);
+  const std::uint64_t first = std::max(g_trace_cleared.load(std::memory_order_relaxed), head > trace_buffer_size ? head - trace_buffer_size : std::uint64_t(0));
+
+  std::stringstream out;
+  out << std::fixed << std::setprecision(3);
+  out << "{\"traceEvents\":[";
+  bool first_event = true;
+  for(std::uint64_t i = first; i < head; ++i)
+  {
+    TraceSlot& slot = g_trace_slots[i & (trace_buffer_size - 1)];
+    const std::uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if(sequence != 2*i + 2)
+    {
+      continue; // still being written, or already overwritten
+    }
+    const std::uint64_t start_ns = slot.start_ns.load(std::memory_order_relaxed);
+    const std::uint64_t duration_ns = slot.duration_ns.load(std::memory_order_relaxed);
+    const std::uint64_t kind_and_thread = slot.kind_and_thread.load(std::memory_order_relaxed);
+    const std::uint64_t id = slot.id.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if(slot.sequence.load(std::memory_order_relaxed) != sequence)
+    {
+      continue;
+    }
+
+    std::string name;
+    const char* category = "";
+    switch(static_cast<TraceKind>(kind_and_thread & 0xff))
+    {
+      case TraceKind::CppCall:
+      {
+        category = "cpp_call";
+        if(id < functions.size())
+        {
+          name = functions[id].module_name + "." + function_name(*functions[id].wrapper);
+        }
+        break;
+      }
+      case TraceKind::JuliaCall:
+        category = "julia_call";
+        name = id < names.size() ? names[id] : "";
+        break;
+      case TraceKind::Finalizer:
+        category = "finalizer";
+        name = id < names.size() ? names[id] : "";
+        break;
+    }
+
+    out << (first_event ? "\n" : ",\n") << "{\"name\":";
+    write_json_string(out, name);
+    out << ",\"cat\":\"" << category << "\",\"ph\":\"X\",\"ts\":" << start_ns / 1000. << ",\"dur\":" << duration_ns / 1000.
+        << ",\"pid\":0,\"tid\":" << (kind_and_thread >> 8) << "}";
+    first_event = false;
+  }
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+  return out.str();
+}
+
+}
@@ -0,0 +1,166 @@
+#ifndef CXX_WRAP_INSTRUMENTATION_HPP
+#define CXX_WRAP_INSTRUMENTATION_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+#include <julia.h>
+
+#ifndef CXX_WRAP_EXPORT
+#ifdef _WIN32
+  #define  CXX_WRAP_EXPORT __declspec(dllexport)
+#else
+   #define  CXX_WRAP_EXPORT
+#endif
+#endif
+
+// Call statistics for the functions of instrumented modules, see Module::set_instrumented, and timeline tracing
+
+namespace cxx_wrap
+{
+
+class FunctionWrapperBase;
+
+namespace detail
+{
+
+/// Number of buckets in the latency histogram. Bucket i counts the calls taking from 2^i up to 2^(i+1) ns, bucket 0 also the calls under 1 ns and the last one the remainder.
+static constexpr int nb_latency_buckets = 32;
+
+/// Counters for one function, updated only by the thread that owns them
+struct CallCounters
+{
+  std::atomic<std::uint64_t> calls;
+  std::atomic<std::uint64_t> total_ns;
+  std::atomic<std::uint64_t> exceptions;
+  std::atomic<std::uint64_t> histogram[nb_latency_buckets];
+};
+
+/// Add n to a counter of CallCounters. Only the owning thread writes, so no atomic read-modify-write is needed.
+inline void add_to_counter(std::atomic<std::uint64_t>& counter, const std::uint64_t n)
+{
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/// Register a function for instrumentation when it is bound in Julia, returning its id. The wrapper must outlive the instrumentation.
+/// A function with the same module, name and argument types as an earlier one, e.g. after loading the library again, takes over its id and counters.
+CXX_WRAP_EXPORT std::size_t register_instrumented_function(const std::string& module_name, const FunctionWrapperBase* wrapper);
+
+/// Counters for the calling thread for the function with the given id
+CXX_WRAP_EXPORT CallCounters& call_counters(const std::size_t id);
+
+/// Origin of a trace event
+enum class TraceKind : std::uint8_t
+{
+  CppCall, // call from Julia to a function of an instrumented module, id is the function id
+  JuliaCall, // call to Julia through JuliaFunction, id is a trace name id
+  Finalizer // finalizer of a wrapped C++ object, id is a trace name id
+};
+
+/// True while trace events are recorded
+CXX_WRAP_EXPORT extern std::atomic<bool> g_tracing_enabled;
+
+inline bool tracing_enabled()
+{
+  return g_tracing_enabled.load(std::memory_order_relaxed);
+}
+
+/// Id for a name used in trace events, the same name always gets the same id
+CXX_WRAP_EXPORT std::size_t trace_name_id(const std::string& name);
+
+/// Store an event in the trace ring buffer, overwriting the oldest event when it is full. Does not lock.
+CXX_WRAP_EXPORT void record_trace_event(const TraceKind kind, const std::size_t id, const std::chrono::steady_clock::time_point start, const std::chrono::steady_clock::time_point end);
+
+/// Records a trace event for its scope, when tracing is enabled at construction
+class TraceSpan
+{
+public:
+  TraceSpan(const TraceKind kind, const std::size_t id) : m_kind(kind), m_id(id), m_enabled(tracing_enabled())
+  {
+    if(m_enabled)
+    {
+      m_start = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~TraceSpan()
+  {
+    if(m_enabled)
+    {
+      record_trace_event(m_kind, m_id, m_start, std::chrono::steady_clock::now());
+    }
+  }
+
+private:
+  const TraceKind m_kind;
+  const std::size_t m_id;
+  const bool m_enabled;
+  std::chrono::steady_clock::time_point m_start;
+};
+
+inline int latency_bucket(std::uint64_t ns)
+{
+  int bucket = 0;
+  while((ns >>= 1) != 0 && bucket != nb_latency_buckets - 1)
+  {
+    ++bucket;
+  }
+  return bucket;
+}
+
+/// Records a call when going out of scope, including when an exception is thrown
+class CallTimer
+{
+public:
+  CallTimer(const std::size_t id) : m_id(id), m_counters(call_counters(id)), m_start(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~CallTimer()
+  {
+    const std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    const std::uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - m_start).count();
+    if(tracing_enabled())
+    {
+      record_trace_event(TraceKind::CppCall, m_id, m_start, end);
+    }
+    add_to_counter(m_counters.calls, 1);
+    add_to_counter(m_counters.total_ns, ns);
+    add_to_counter(m_counters.histogram[latency_bucket(ns)], 1);
+  }
+
+  void exception()
+  {
+    add_to_counter(m_counters.exceptions, 1);
+  }
+
+private:
+  const std::size_t m_id;
+  CallCounters& m_counters;
+  const std::chrono::steady_clock::time_point m_start;
+};
+
+} // namespace detail
+
+/// Statistics for all instrumented functions, summed over all threads, as an array of CxxWrap.FunctionStats
+CXX_WRAP_EXPORT jl_array_t* function_stats();
+
+/// Set all counters to zero
+CXX_WRAP_EXPORT void reset_function_stats();
+
+/// Start or stop recording trace events. The buffer keeps the last trace_buffer_size events.
+CXX_WRAP_EXPORT void set_tracing(const bool enabled);
+
+static constexpr std::size_t trace_buffer_size = 1 << 16;
+
+/// The recorded events in the Chrome trace event format (JSON), which can be loaded in chrome://tracing or Perfetto
+CXX_WRAP_EXPORT std::string trace_json();
+
+/// Remove all recorded events
+CXX_WRAP_EXPORT void clear_trace();
+
+} // namespace cxx_wrap
+
+#endif
@@ -0,0 +1,175 @@
+#ifndef OBJECT_POOL_HPP
+#define OBJECT_POOL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace cxx_wrap
+{
+
+/// Trait to allocate objects of type T from a per-type pool instead of using new and delete
+template<typename T> struct UsePool : std::false_type {};
+
+/// Statistics for an ObjectPool, corresponds to the Julia immutable with the same name
+struct PoolStats
+{
+  int64_t capacity; // Number of object slots allocated in all slabs
+  int64_t live; // Objects created and not yet released
+  int64_t pending; // Slots of destroyed objects not yet returned to the free list
+  int64_t slabs; // Number of slabs
+  int64_t batches; // Number of times a batch of released slots was returned to the free list
+};
+
+/// Slab allocator for objects of type T. Released objects are destroyed right away, and their slots are returned to the free list in batches.
+/// Each pool has its own mutex, held only while updating the free list: constructors and destructors run unlocked, and releasing a slot doesn't lock.
+template<typename T>
+class ObjectPool
+{
+public:
+  /// Number of released slots that are returned to the free list at once
+  static constexpr std::size_t batch_size = 256;
+  static constexpr std::size_t max_slab_size = 4096;
+
+  static ObjectPool& instance()
+  {
+    static ObjectPool pool;
+    return pool;
+  }
+
+  /// Allocate a slot and construct the object in it
+  template<typename... ArgsT>
+  T* create(ArgsT&&... args)
+  {
+    Slot* slot = pop_slot();
+    T* result = nullptr;
+    try
+    {
+      result = new (&slot->storage) T(std::forward<ArgsT>(args)...);
+    }
+    catch(...)
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      slot->next = m_free;
+      m_free = slot;
+      m_nb_live.fetch_sub(1, std::memory_order_relaxed);
+      throw;
+    }
+    return result;
+  }
+
+  /// Destroy an object and queue its slot for reuse. Called from the finalizer.
+  void release(T* obj)
+  {
+    obj->~T();
+    Slot* slot = reinterpret_cast<Slot*>(obj);
+    slot->next = m_released.load(std::memory_order_relaxed);
+    while(!m_released.compare_exchange_weak(slot->next, slot, std::memory_order_release, std::memory_order_relaxed))
+    {
+    }
+    m_nb_live.fetch_sub(1, std::memory_order_relaxed);
+    if(m_nb_released.fetch_add(1, std::memory_order_relaxed) + 1 >= static_cast<int64_t>(batch_size))
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      reclaim_released();
+    }
+  }
+
+  PoolStats stats() const
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return {m_capacity, m_nb_live.load(std::memory_order_relaxed), m_nb_released.load(std::memory_order_relaxed), static_cast<int64_t>(m_slabs.size()), m_nb_batches};
+  }
+
+private:
+  union Slot
+  {
+    Slot* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  ObjectPool() = default;
+
+  ObjectPool(const ObjectPool&) = delete;
+  ObjectPool& operator=(const ObjectPool&) = delete;
+
+  /// Move all released slots to the free list. Must be called with the mutex held.
+  void reclaim_released()
+  {
+    Slot* released = m_released.exchange(nullptr, std::memory_order_acquire);
+    if(released == nullptr)
+    {
+      return;
+    }
+    int64_t nb_reclaimed = 1;
+    Slot* last = released;
+    while(last->next != nullptr)
+    {
+      last = last->next;
+      ++nb_reclaimed;
+    }
+    last->next = m_free;
+    m_free = released;
+    m_nb_released.fetch_sub(nb_reclaimed, std::memory_order_relaxed);
+    ++m_nb_batches;
+  }
+
+  /// Take a slot from the free list, reusing released slots or adding a slab if it is empty
+  Slot* pop_slot()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_free == nullptr)
+    {
+      reclaim_released();
+    }
+    if(m_free == nullptr)
+    {
+      add_slab();
+    }
+    Slot* slot = m_free;
+    m_free = slot->next;
+    m_nb_live.fetch_add(1, std::memory_order_relaxed);
+    return slot;
+  }
+
+  /// Allocate a slab with raw storage, since new[] doesn't respect the alignment of over-aligned types before C++17
+  void add_slab()
+  {
+    m_slab_size = std::min(2*m_slab_size, max_slab_size);
+    std::size_t space = m_slab_size*sizeof(Slot) + alignof(Slot) - 1;
+    std::unique_ptr<char[]> storage(new char[space]);
+    void* aligned = storage.get();
+    std::align(alignof(Slot), m_slab_size*sizeof(Slot), aligned, space);
+    Slot* slab = static_cast<Slot*>(aligned);
+    m_slabs.push_back(std::move(storage));
+    for(std::size_t i = m_slab_size; i != 0; --i)
+    {
+      slab[i-1].next = m_free;
+      m_free = &slab[i-1];
+    }
+    m_capacity += m_slab_size;
+  }
+
+  mutable std::mutex m_mutex;
+  std::vector<std::unique_ptr<char[]>> m_slabs;
+  Slot* m_free = nullptr;
+  /// Lock-free stack of the slots of destroyed objects, moved to m_free in batches
+  std::atomic<Slot*> m_released{nullptr};
+  std::atomic<int64_t> m_nb_released{0};
+  std::atomic<int64_t> m_nb_live{0};
+  std::size_t m_slab_size = 32;
+  int64_t m_capacity = 0;
+  int64_t m_nb_batches = 0;
+};
+
+template<typename T> constexpr std::size_t ObjectPool<T>::batch_size;
+template<typename T> constexpr std::size_t ObjectPool<T>::max_slab_size;
+
+} // namespace cxx_wrap
+#endif
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace cxx_wrap
+{
+
+namespace
+{
+
+/// True on the worker threads, where nested parallel loops run serially
+thread_local bool t_is_worker = false;
+
+/// One call to run_chunks. Threads claim chunks by incrementing next until all are taken.
+struct Job
+{
+  Job(const std::size_t n, const std::function<void(std::size_t)>& f) : nb_chunks(n), chunk_fn(f)
+  {
+  }
+
+  /// Run chunks until none are left, returning true if the last chunk was finished by this call
+  bool work()
+  {
+    bool finished_last = false;
+    std::size_t i;
+    while((i = next.fetch_add(1)) < nb_chunks)
+    {
+      try
+      {
+        chunk_fn(i);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if(!error)
+        {
+          error = std::current_exception();
+        }
+      }
+      finished_last = done.fetch_add(1) + 1 == nb_chunks;
+    }
+    return finished_last;
+  }
+
+  bool has_chunks() const
+  {
+    return next.load() < nb_chunks;
+  }
+
+  const std::size_t nb_chunks;
+  const std::function<void(std::size_t)>& chunk_fn;
+  std::atomic<std::size_t> next{0};
+  std::atomic<std::size_t> done{0};
+  std::size_t nb_workers = 0; // workers that may still access the job, guarded by the pool mutex
+  std::mutex error_mutex;
+  std::exception_ptr error;
+};
+
+std::size_t default_pool_size()
+{
+  const char* env = std::getenv("JULIA_NUM_THREADS");
+  if(env != nullptr)
+  {
+    const long n = std::strtol(env, nullptr, 10);
+    if(n > 0)
+    {
+      return n;
+    }
+  }
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+class ThreadPool
+{
+public:
+  std::size_t size()
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_size;
+  }
+
+  /// Stop the workers, new ones are started for the next job
+  void resize(const std::size_t nb_threads)
+  {
+    std::lock_guard<std::mutex> resize_lock(m_resize_mutex);
+    std::vector<std::thread> workers;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+      workers.swap(m_workers);
+    }
+    m_work_cv.notify_all();
+    for(std::thread& worker : workers)
+    {
+      worker.join();
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = false;
+    m_size = nb_threads == 0 ? default_pool_size() : nb_threads;
+    if(!m_tasks.empty())
+    {
+      start_workers(1);
+    }
+  }
+
+  void submit(std::function<void()> task)
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_tasks.push_back(std::move(task));
+      start_workers(1);
+    }
+    m_work_cv.notify_one();
+  }
+
+  void run(const std::size_t nb_chunks, const std::function<void(std::size_t)>& chunk_fn)
+  {
+    Job job(nb_chunks, chunk_fn);
+    if(t_is_worker)
+    {
+      job.work();
+    }
+    else
+    {
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        start_workers(0);
+        m_jobs.push_back(&job);
+      }
+      m_work_cv.notify_all();
+
+      // Workers never wait for the garbage collector, so blocking here can only delay a collection until the job is done
+      job.work();
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_done_cv.wait(lock, [&job]() { return job.done.load() == job.nb_chunks && job.nb_workers == 0; });
+      // The job may still be queued if the workers never looked at it
+      m_jobs.erase(std::remove(m_jobs.begin(), m_jobs.end(), &job), m_jobs.end());
+    }
+
+    if(job.error)
+    {
+      std::rethrow_exception(job.error);
+    }
+  }
+
+private:
+  /// Start the workers for the pool size, and at least min_workers. Called with m_mutex locked.
+  void start_workers(const std::size_t min_workers)
+  {
+    while(m_workers.size() + 1 < m_size || m_workers.size() < min_workers)
+    {
+      m_workers.emplace_back([this]() { worker_loop(); });
+    }
+  }
+
+  /// First queued job with chunks left, dropping the exhausted ones. Called with m_mutex locked.
+  Job* next_job()
+  {
+    while(!m_jobs.empty() && !m_jobs.front()->has_chunks())
+    {
+      m_jobs.pop_front();
+    }
+    if(m_jobs.empty())
+    {
+      return nullptr;
+    }
+    ++m_jobs.front()->nb_workers;
+    return m_jobs.front();
+  }
+
+  void worker_loop()
+  {
+    t_is_worker = true;
+    while(true)
+    {
+      Job* job = nullptr;
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_work_cv.wait(lock, [this, &job]() { return m_stop || (job = next_job()) != nullptr || !m_tasks.empty(); });
+        if(m_stop)
+        {
+          return;
+        }
+        // Jobs go first, since their callers are waiting
+        if(job == nullptr)
+        {
+          task = std::move(m_tasks.front());
+          m_tasks.pop_front();
+        }
+      }
+      if(job == nullptr)
+      {
+        task();
+        continue;
+      }
+      // The caller keeps the job alive until nb_workers drops to zero
+      const bool finished_last = job->work();
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if(--job->nb_workers == 0 || finished_last)
+      {
+        m_done_cv.notify_all();
+      }
+    }
+  }
+
+  std::mutex m_mutex;
+  std::mutex m_resize_mutex;
+  std::condition_variable m_work_cv;
+  std::condition_variable m_done_cv;
+  std::deque<Job*> m_jobs;
+  std::deque<std::function<void()>> m_tasks;
+  std::vector<std::thread> m_workers;
+  std::size_t m_size = default_pool_size();
+  bool m_stop = false;
+};
+
+ThreadPool& thread_pool()
+{
+  // Never deleted: joining the workers from a static destructor can deadlock when the library is unloaded
+  static ThreadPool* m_pool = new ThreadPool();
+  return *m_pool;
+}
+
+}
+
+CXX_WRAP_EXPORT std::size_t thread_pool_size()
+{
+  return thread_pool().size();
+}
+
+CXX_WRAP_EXPORT void set_thread_pool_size(const std::size_t nb_threads)
+{
+  thread_pool().resize(nb_threads);
+}
+
+namespace detail
+{
+
+CXX_WRAP_EXPORT void run_chunks(const std::size_t nb_chunks, const std::function<void(std::size_t)>& chunk_fn)
+{
+  thread_pool().run(nb_chunks, chunk_fn);
+}
+
+CXX_WRAP_EXPORT void submit_task(std::function<void()> task)
+{
+  thread_pool().submit(std::move(task));
+}
+
+}
+
+}
@@ -0,0 +1,66 @@
+#ifndef CXX_WRAP_THREAD_POOL_HPP
+#define CXX_WRAP_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+
+#include <julia.h>
+
+#ifndef CXX_WRAP_EXPORT
+#ifdef _WIN32
+  #define  CXX_WRAP_EXPORT __declspec(dllexport)
+#else
+   #define  CXX_WRAP_EXPORT
+#endif
+#endif
+
+// Worker threads shared by all wrapped modules, for parallel loops over data that doesn't involve Julia
+
+namespace cxx_wrap
+{
+
+/// Number of threads used by parallel_for, including the calling thread. Defaults to JULIA_NUM_THREADS, or the number of cores if it is not set.
+CXX_WRAP_EXPORT std::size_t thread_pool_size();
+
+/// Change the number of threads used by parallel_for. 0 restores the default.
+CXX_WRAP_EXPORT void set_thread_pool_size(const std::size_t nb_threads);
+
+namespace detail
+{
+  /// Call chunk_fn(i) for each i in [0, nb_chunks) using the pool and the calling thread, returning when all chunks are done.
+  /// The first exception thrown by a chunk is rethrown.
+  CXX_WRAP_EXPORT void run_chunks(const std::size_t nb_chunks, const std::function<void(std::size_t)>& chunk_fn);
+
+  /// Run task on a worker thread without waiting for it. A worker is started even if the pool size is 1. task must not throw.
+  CXX_WRAP_EXPORT void submit_task(std::function<void()> task);
+}
+
+/// Call f(begin, end) on chunks of at most chunk_size indices covering [0, n), spread over the shared thread pool.
+/// Idle threads take the next chunk, so chunks of uneven cost are balanced. f must not call into Julia.
+template<typename FunctorT>
+void parallel_for(const std::size_t n, const std::size_t chunk_size, const FunctorT& f)
+{
+  if(chunk_size == 0)
+  {
+    throw std::runtime_error("parallel_for chunk size must be positive");
+  }
+  const std::size_t nb_chunks = (n + chunk_size - 1) / chunk_size;
+  if(nb_chunks <= 1 || thread_pool_size() == 1)
+  {
+    if(n != 0)
+    {
+      f(std::size_t(0), n);
+    }
+    return;
+  }
+  detail::run_chunks(nb_chunks, [&f, n, chunk_size](const std::size_t i)
+  {
+    f(i*chunk_size, std::min(n, (i+1)*chunk_size));
+  });
+}
+
+} // namespace cxx_wrap
+
+#endif
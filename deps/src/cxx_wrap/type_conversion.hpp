@@ -6,21 +6,21 @@
 #include <julia_threads.h>
 #endif
 
-#include <map>
+#include <algorithm>
+#include <atomic>
+#include <iterator>
 #include <memory>
-#include <stack>
+#include <new>
 #include <stdexcept>
 #include <string>
 #include <typeinfo>
 #include <typeindex>
 #include <type_traits>
+#include <utility>
 #include <iostream>
 
-#ifdef _WIN32
-  #define  CXX_WRAP_EXPORT __declspec(dllexport)
-#else
-   #define  CXX_WRAP_EXPORT
-#endif
+#include "instrumentation.hpp"
+#include "object_pool.hpp"
 
 namespace cxx_wrap
 {
@@ -46,42 +46,64 @@ namespace detail
 }
 
 CXX_WRAP_EXPORT jl_array_t* gc_protected();
-CXX_WRAP_EXPORT std::stack<std::size_t>& gc_free_stack();
-CXX_WRAP_EXPORT std::map<jl_value_t*, std::size_t>& gc_index_map();
 
+namespace detail
+{
+  /// Add a root for val in gc_protected(). Protecting the same value multiple times requires the same number of unprotect calls.
+  CXX_WRAP_EXPORT void gc_protect(jl_value_t* val);
+  /// Release a root that was added by gc_protect
+  CXX_WRAP_EXPORT void gc_unprotect(jl_value_t* val);
+  /// Make sure that n values can be protected without growing the root table
+  CXX_WRAP_EXPORT void gc_reserve(std::size_t n);
+
+  /// Count memory owned by a new wrapped object, running a garbage collection when enough was added since the last one
+  CXX_WRAP_EXPORT void add_external_memory(const void* obj, const std::size_t nb_bytes);
+  /// Stop counting the memory of an object before it is deleted, using the size counted when it was created
+  CXX_WRAP_EXPORT void remove_external_memory(const void* obj);
+
+  /// Base of the default SizeOf, so types with a specialized SizeOf can be detected
+  struct UnsizedObject
+  {
+  };
+}
+
+/// Memory reported through SizeOf for all live wrapped objects, in bytes
+CXX_WRAP_EXPORT std::size_t external_memory();
+
+/// Run a garbage collection once this many bytes, or the live bytes after the last collection if more, were reported through SizeOf. 0 restores the default of 64 MiB.
+CXX_WRAP_EXPORT void set_external_gc_interval(const std::size_t nb_bytes);
 
 template<typename T>
 inline void protect_from_gc(T* val)
 {
-  JL_GC_PUSH1(&val);
-  std::size_t pos = 0;
-  if(gc_free_stack().empty())
-  {
-    pos = jl_array_len(gc_protected());
-    jl_array_grow_end(gc_protected(), 1);
-  }
-  else
+  detail::gc_protect((jl_value_t*)val);
+}
+
+/// Protect all values in the range [begin, end), growing the root table only once
+template<typename IteratorT>
+inline void protect_from_gc(IteratorT begin, IteratorT end)
+{
+  detail::gc_reserve(std::distance(begin, end));
+  for(; begin != end; ++begin)
   {
-    pos = gc_free_stack().top();
-    gc_free_stack().pop();
+    detail::gc_protect((jl_value_t*)(*begin));
   }
-  jl_arrayset(gc_protected(), (jl_value_t*)(val), pos);
-  gc_index_map()[(jl_value_t*)val] = pos;
-  JL_GC_POP();
 }
 
 template<typename T>
 inline void unprotect_from_gc(T* val)
 {
-  const auto found = gc_index_map().find((jl_value_t*)val);
-  if(found == gc_index_map().end())
+  detail::gc_unprotect((jl_value_t*)val);
+}
+
+/// Unprotect all values in the range [begin, end)
+template<typename IteratorT>
+inline void unprotect_from_gc(IteratorT begin, IteratorT end)
+{
+  for(; begin != end; ++begin)
   {
-    std::cout << "WARNING: attempt to unprotect a jl_value_t* that was never protected" << std::endl;
-    return;
+    detail::gc_unprotect((jl_value_t*)(*begin));
   }
-  gc_free_stack().push(found->second);
-  jl_arrayset(gc_protected(), jl_nothing, found->second);
-  gc_index_map().erase(found);
 }
 
 /// Get the symbol name correctly depending on Julia version
@@ -113,11 +135,91 @@ inline const char* julia_string(jl_value_t* v)
   #endif
 }
 
+/// Number of bytes in a Julia string
+inline std::size_t julia_string_length(jl_value_t* v)
+{
+  #if JULIA_VERSION_MAJOR == 0 && JULIA_VERSION_MINOR < 5
+    return jl_bytestring_length(v);
+  #else
+    return jl_string_len(v);
+  #endif
+}
+
 inline std::string julia_type_name(jl_datatype_t* dt)
 {
   return jl_typename_str((jl_value_t*)dt);
 }
 
+/// Read-only view of the bytes of a string, without copying. As an argument of a wrapped function, it points into the memory
+/// of the Julia string, so it is only valid during the call unless the string is kept alive.
+class StringRef
+{
+public:
+  typedef const char* const_iterator;
+
+  StringRef() : m_data(""), m_size(0)
+  {
+  }
+
+  StringRef(const char* data, const std::size_t size) : m_data(data), m_size(size)
+  {
+  }
+
+  StringRef(const std::string& str) : m_data(str.data()), m_size(str.size())
+  {
+  }
+
+  const char* data() const
+  {
+    return m_data;
+  }
+
+  std::size_t size() const
+  {
+    return m_size;
+  }
+
+  bool empty() const
+  {
+    return m_size == 0;
+  }
+
+  const_iterator begin() const
+  {
+    return m_data;
+  }
+
+  const_iterator end() const
+  {
+    return m_data + m_size;
+  }
+
+  char operator[](const std::size_t i) const
+  {
+    return m_data[i];
+  }
+
+  /// Copy into a std::string
+  std::string str() const
+  {
+    return std::string(m_data, m_size);
+  }
+
+  bool operator==(const StringRef& other) const
+  {
+    return m_size == other.m_size && std::equal(m_data, m_data + m_size, other.m_data);
+  }
+
+  bool operator!=(const StringRef& other) const
+  {
+    return !(*this == other);
+  }
+
+private:
+  const char* m_data;
+  std::size_t m_size;
+};
+
 /// Base type for all wrapped classes
 struct CppAny
 {
@@ -129,6 +231,25 @@ template<typename T> struct IsImmutable : std::false_type {};
 /// Trait to determine if the given type is to be treated as a bits type
 template<typename T> struct IsBits : std::false_type {};
 
+/// Trait to mark an immutable whose fields are all bits types, so Julia stores it inline in arrays and ArrayRef uses the elements in place
+template<typename T> struct IsBitsImmutable : std::false_type {};
+
+/// Trait to store a small, trivially copyable wrapped type directly in the Julia object instead of behind a pointer
+template<typename T> struct IsInline : std::false_type {};
+
+/// Trait to mark a class added with add_type, so it can be returned by value. Converting other classes by value fails to compile.
+template<typename T> struct IsWrapped : std::false_type {};
+
+/// Specialize to report the memory owned by a wrapped object, which the garbage collector doesn't see otherwise.
+/// bytes is called when the object is created, and the same amount is uncounted when it is deleted.
+template<typename T> struct SizeOf : detail::UnsizedObject
+{
+  static std::size_t bytes(const T&)
+  {
+    return 0;
+  }
+};
+
 /// Remove reference and const from a type
 template<typename T> using remove_const_ref = typename std::remove_const<typename std::remove_reference<T>::type>::type;
 
@@ -192,14 +313,61 @@ namespace detail
     jl_value_t* voidptr;
   };
 
+  /// Allocate a new C++ object, either using new or from the pool for the type
+  template<typename T, bool Pooled = UsePool<T>::value>
+  struct NewObject
+  {
+    template<typename... ArgsT>
+    T* operator()(ArgsT&&... args) const
+    {
+      return new T(std::forward<ArgsT>(args)...);
+    }
+  };
+
+  template<typename T>
+  struct NewObject<T, true>
+  {
+    template<typename... ArgsT>
+    T* operator()(ArgsT&&... args) const
+    {
+      return ObjectPool<T>::instance().create(std::forward<ArgsT>(args)...);
+    }
+  };
+
+  /// Release an object allocated using NewObject
+  template<typename T, bool Pooled = UsePool<T>::value>
+  struct DeleteObject
+  {
+    void operator()(T* obj) const
+    {
+      delete obj;
+    }
+  };
+
+  template<typename T>
+  struct DeleteObject<T, true>
+  {
+    void operator()(T* obj) const
+    {
+      ObjectPool<T>::instance().release(obj);
+    }
+  };
+
   /// Finalizer function for type T
   template<typename T>
   void finalizer(jl_value_t* to_delete)
   {
+    // Finalizers run on the Julia thread, so the name of the wrapper type can be looked up when first needed
+    static const std::size_t trace_id = trace_name_id(julia_type_name((jl_datatype_t*)jl_typeof(to_delete)));
+    TraceSpan span(TraceKind::Finalizer, trace_id);
     T* stored_obj = convert_to_cpp<T*>(to_delete);
     if(stored_obj != nullptr)
     {
-      delete stored_obj;
+      if(!std::is_base_of<UnsizedObject, SizeOf<T>>::value)
+      {
+        remove_external_memory(stored_obj);
+      }
+      DeleteObject<T>()(stored_obj);
     }
 
     reinterpret_cast<WrappedCppPtr*>(to_delete)->voidptr = nullptr;
@@ -314,6 +482,7 @@ template<typename SourceT> struct CXX_WRAP_EXPORT static_type_mapping
   }
 
 private:
+  // Set while registering the type, before other threads can use it, so reading them needs no synchronization
   static jl_datatype_t*& type_pointer()
   {
     static jl_datatype_t* m_type_pointer = nullptr;
@@ -501,6 +670,13 @@ template<> struct static_type_mapping<std::string>
   static jl_datatype_t* julia_type() { return (jl_datatype_t*)jl_get_global(jl_base_module, jl_symbol("AbstractString")); }
 };
 
+template<> struct IsValueType<StringRef> : std::true_type {};
+template<> struct static_type_mapping<StringRef>
+{
+  typedef jl_value_t* type;
+  static jl_datatype_t* julia_type() { return (jl_datatype_t*)jl_get_global(jl_base_module, jl_symbol("AbstractString")); }
+};
+
 template<> struct static_type_mapping<const char*>
 {
   typedef jl_value_t* type;
@@ -544,15 +720,19 @@ template<> struct static_type_mapping<ObjectIdDict>
   static jl_datatype_t* julia_type() { return (jl_datatype_t*)jl_get_global(jl_base_module, jl_symbol("ObjectIdDict")); }
 };
 
-/// Base class to specialize for conversion to Julia
+/// Create an object with a finalizer attached, defined in cxx_wrap.hpp
+template<typename T, typename... ArgsT>
+typename static_type_mapping<T>::type create(ArgsT&&... args);
+
+/// Base class to specialize for conversion to Julia. Classes marked with IsWrapped are copied, or moved if they are returned by value.
 template<typename T, bool Fundamental=false, bool Immutable=false, bool Bits=false>
 struct ConvertToJulia
 {
   template<typename CppT>
   jl_value_t* operator()(CppT&& cpp_val) const
   {
-    static_assert(sizeof(T)==0, "No appropriate specialization for ConvertToJulia");
-    return nullptr; // not reached
+    static_assert(IsWrapped<T>::value, "No appropriate specialization for ConvertToJulia, specialize IsWrapped to return a type added with add_type by value");
+    return create<T>(std::forward<CppT>(cpp_val));
   }
 };
 
@@ -597,6 +777,43 @@ struct ConvertToJulia<T, false, false, true>
   }
 };
 
+namespace detail
+{
+  /// Allocate a Julia object of type dt and construct the C++ object inside it
+  template<typename T, typename... ArgsT>
+  jl_value_t* new_inline(jl_datatype_t* dt, ArgsT&&... args)
+  {
+    assert(jl_datatype_size(dt) == sizeof(T));
+    jl_value_t* result = jl_new_struct_uninit(dt);
+    new (jl_data_ptr(result)) T(std::forward<ArgsT>(args)...);
+    return result;
+  }
+
+  /// Box a pointer to a wrapped C++ object
+  template<typename T, bool Inline = IsInline<typename std::remove_const<T>::type>::value>
+  struct BoxCppPointer
+  {
+    jl_value_t* operator()(jl_datatype_t* dt, T* cpp_obj) const
+    {
+      jl_value_t* result = nullptr;
+      jl_value_t* void_ptr = nullptr;
+      JL_GC_PUSH2(&result, &void_ptr);
+      void_ptr = jl_box_voidpointer(static_cast<void*>(const_cast<typename std::remove_const<T>::type*>(cpp_obj)));
+      result = jl_new_struct(dt, void_ptr);
+      assert(convert_to_cpp<T*>(result) == cpp_obj);
+      JL_GC_POP();
+      return result;
+    }
+  };
+
+  // Inline types can't refer to an object elsewhere, and silently copying would lose changes made through the pointer
+  template<typename T>
+  struct BoxCppPointer<T, true>
+  {
+    static_assert(sizeof(T) == 0, "Pointers and references to inline types (marked with IsInline) can't be returned to Julia, return by value instead");
+  };
+}
+
 // Pointer to wrapped type
 template<typename T>
 struct ConvertToJulia<T*, false, false, false>
@@ -605,15 +822,7 @@ struct ConvertToJulia<T*, false, false, false>
   {
     jl_datatype_t* dt = static_type_mapping<typename std::remove_const<T>::type>::julia_instantiable_type();
     assert(!jl_isbits(dt));
-
-    jl_value_t* result = nullptr;
-    jl_value_t* void_ptr = nullptr;
-    JL_GC_PUSH2(&result, &void_ptr);
-    void_ptr = jl_box_voidpointer(static_cast<void*>(const_cast<typename std::remove_const<T>::type*>(cpp_obj)));
-    result = jl_new_struct(dt, void_ptr);
-    assert(convert_to_cpp<T*>(result) == cpp_obj);
-    JL_GC_POP();
-    return result;
+    return detail::BoxCppPointer<T>()(dt, cpp_obj);
   }
 };
 
@@ -622,7 +831,16 @@ struct ConvertToJulia<std::string, false, false, false>
 {
   jl_value_t* operator()(const std::string& str) const
   {
-    return jl_cstr_to_string(str.c_str());
+    return jl_pchar_to_string(str.data(), str.size());
+  }
+};
+
+template<>
+struct ConvertToJulia<StringRef, false, false, false>
+{
+  jl_value_t* operator()(const StringRef& str) const
+  {
+    return jl_pchar_to_string(str.data(), str.size());
   }
 };
 
@@ -929,6 +1147,11 @@ struct JuliaUnpacker
 
     if(!jl_isbits(dt))
     {
+      if(IsInline<stripped_cpp_t>::value)
+      {
+        // The C++ object is stored in the Julia object itself
+        return reinterpret_cast<stripped_cpp_t*>(jl_data_ptr(julia_value));
+      }
       //Get the pointer to the C++ class
       return reinterpret_cast<stripped_cpp_t*>(jl_data_ptr(reinterpret_cast<WrappedCppPtr*>(julia_value)->voidptr));
     }
@@ -975,6 +1198,46 @@ struct ConvertToCpp<CppT, false, false, false>
   }
 };
 
+/// Argument type for functions that take over a wrapped object without copying it, passed from Julia as CxxWrap.Moved(x).
+/// The Julia object remains valid, in the moved-from state.
+template<typename T>
+class Moved
+{
+public:
+  explicit Moved(T* obj) : m_obj(obj)
+  {
+  }
+
+  /// Move the object out of the Julia object
+  T take() const
+  {
+    return std::move(*m_obj);
+  }
+
+  T& get() const
+  {
+    return *m_obj;
+  }
+
+private:
+  T* m_obj;
+};
+
+template<typename T> struct IsValueType<Moved<T>> : std::true_type {};
+
+template<typename T>
+struct ConvertToCpp<Moved<T>, false, false, false>
+{
+  Moved<T> operator()(jl_value_t* julia_value) const
+  {
+    T* obj = convert_to_cpp<T*>(jl_fieldref(julia_value, 0));
+    if(obj == nullptr)
+    {
+      throw std::runtime_error("C++ object was deleted");
+    }
+    return Moved<T>(obj);
+  }
+};
 
 // pass-through for jl_value_t*
 template<>
@@ -1012,12 +1275,21 @@ struct ConvertToCpp<const char*, false, false, false>
   }
 };
 
+template<>
+struct ConvertToCpp<StringRef, false, false, false>
+{
+  StringRef operator()(jl_value_t* jstr) const
+  {
+    return StringRef(ConvertToCpp<const char*, false, false, false>()(jstr), julia_string_length(jstr));
+  }
+};
+
 template<>
 struct ConvertToCpp<std::string, false, false, false>
 {
   std::string operator()(jl_value_t* jstr) const
   {
-    return std::string(ConvertToCpp<const char*, false, false, false>()(jstr));
+    return ConvertToCpp<StringRef, false, false, false>()(jstr).str();
   }
 };
 
@@ -1131,9 +1403,47 @@ inline jl_datatype_t* julia_type()
   return static_type_mapping<T>::julia_type();
 }
 
-/// Get the type from a global symbol
+/// Get the type from a global symbol. Results are cached until CxxWrap is initialized again or a module is registered or wrapped.
 CXX_WRAP_EXPORT jl_datatype_t* julia_type(const std::string& name, const std::string& module_name = "");
 
+namespace detail
+{
+  /// Changes each time CxxWrap is initialized or a module is registered or wrapped, invalidating the cached Julia types
+  CXX_WRAP_EXPORT std::size_t type_cache_generation();
+
+  /// Clear the results cached by julia_type(name, module_name) and start a new cache generation
+  CXX_WRAP_EXPORT void invalidate_type_cache();
+
+  /// A cached type together with the cache generation it was computed in
+  struct CachedType
+  {
+    jl_datatype_t* dt;
+    std::size_t generation;
+  };
+
+  /// Compute a Julia type using f only once per cache generation. Every lambda type gets its own cache entry.
+  /// Safe to call from multiple threads without locking: the type and its generation are published together, and racing threads compute the same type.
+  template<typename FunctorT>
+  inline jl_datatype_t* cached_julia_type(FunctorT f)
+  {
+    static std::atomic<const CachedType*> m_entry(nullptr);
+    const std::size_t generation = type_cache_generation();
+    const CachedType* entry = m_entry.load(std::memory_order_acquire);
+    if(entry != nullptr && entry->generation == generation)
+    {
+      return entry->dt;
+    }
+    jl_datatype_t* dt = f();
+    const CachedType* new_entry = new CachedType({dt, generation});
+    // Replaced entries are not deleted, since other threads may still read them. There is one per generation at most.
+    if(!m_entry.compare_exchange_strong(entry, new_entry, std::memory_order_acq_rel))
+    {
+      delete new_entry;
+    }
+    return dt;
+  }
+}
+
 /// Helper to encapsulate a strictly typed number type. Numbers typed like this will not be involved in the convenience-overloads that allow passing e.g. an Int to a Float64 argument
 template<typename NumberT>
 struct StrictlyTypedNumber
@@ -1146,7 +1456,14 @@ template<typename NumberT> struct IsBits<StrictlyTypedNumber<NumberT>> : std::tr
 template<typename NumberT> struct static_type_mapping<StrictlyTypedNumber<NumberT>>
 {
   typedef NumberT type;
-  static jl_datatype_t* julia_type() { return (jl_datatype_t*)jl_apply_type((jl_value_t*)::cxx_wrap::julia_type("StrictlyTypedNumber"), jl_svec1(static_type_mapping<NumberT>::julia_type())); }
+  static jl_datatype_t* julia_type()
+  {
+    // The applied type is kept alive by the type cache of StrictlyTypedNumber
+    return detail::cached_julia_type([]()
+    {
+      return (jl_datatype_t*)jl_apply_type((jl_value_t*)::cxx_wrap::julia_type("StrictlyTypedNumber"), jl_svec1(static_type_mapping<NumberT>::julia_type()));
+    });
+  }
 };
 
 template<typename NumberT>
@@ -0,0 +1,90 @@
+#include <string>
+#include <tuple>
+
+#include <cxx_wrap.hpp>
+#include <functions.hpp>
+
+// Functions to measure the overhead of each way of calling between Julia and C++, see benchmark/benchmarks.jl
+
+namespace benchmark
+{
+
+double add(const double a, const double b)
+{
+  return a + b;
+}
+
+struct Counter
+{
+  void increment()
+  {
+    ++m_count;
+  }
+
+  int64_t count() const
+  {
+    return m_count;
+  }
+
+  int64_t m_count = 0;
+};
+
+}
+
+JULIA_CPP_MODULE_BEGIN(registry)
+  using namespace benchmark;
+
+  cxx_wrap::Module& mod = registry.create_module("CxxWrapBenchmark");
+
+  // Plain function pointer, called directly from Julia
+  mod.method("direct_add", &add);
+
+  // Lambda with a capture, called through the std::function thunk
+  const double zero = 0.;
+  mod.method("thunk_add", [zero](const double a, const double b) { return a + b + zero; });
+
+  mod.add_type<Counter>("Counter")
+    .method("increment", &Counter::increment)
+    .method("increment_direct", CXX_WRAP_MEMBER(&Counter::increment))
+    .method("count", &Counter::count);
+
+  mod.method("array_sum", [](cxx_wrap::ArrayRef<double> arr)
+  {
+    double result = 0.;
+    for(const double d : arr)
+    {
+      result += d;
+    }
+    return result;
+  });
+
+  // Scalar function broadcast over an array, once with a call per element and once through the vectorized overload
+  mod.method("scalar_half", [](const double d) { return 0.5*d; });
+  mod.vectorized_method("vectorized_half", [](const double d) { return 0.5*d; });
+
+  mod.method("string_length", [](const std::string& s) { return static_cast<int64_t>(s.size()); });
+  mod.method("make_string", []() { return std::string("benchmark"); });
+  mod.method("tuple_return", [](const double d) { return std::make_tuple(d, 2.*d); });
+
+  // Loops calling back into Julia, so the time per iteration is the callback overhead
+  mod.method("julia_callback_loop", [](const int64_t n)
+  {
+    cxx_wrap::JuliaFunction f("benchmark_callback");
+    double result = 0.;
+    for(int64_t i = 0; i != n; ++i)
+    {
+      result = jl_unbox_float64(f(result));
+    }
+    return result;
+  });
+  mod.method("typed_julia_callback_loop", [](const int64_t n)
+  {
+    cxx_wrap::TypedJuliaFunction<double(double)> f("benchmark_callback");
+    double result = 0.;
+    for(int64_t i = 0; i != n; ++i)
+    {
+      result = f(result);
+    }
+    return result;
+  });
+JULIA_CPP_MODULE_END
@@ -1,6 +1,7 @@
 #include <cxx_wrap.hpp>
 #include <containers/tuple.hpp>
 #include <containers/const_array.hpp>
+#include <containers/struct_of_arrays.hpp>
 
 const double* const_vector()
 {
@@ -14,17 +15,73 @@ const double* const_matrix()
   return &d[0][0];
 }
 
+struct Particle
+{
+  double x;
+  double v;
+};
+
+namespace cxx_wrap
+{
+  template<> struct IsImmutable<Particle> : std::true_type {};
+  template<> struct IsBitsImmutable<Particle> : std::true_type {};
+}
+
+typedef cxx_wrap::StructOfArrays<double, double> ParticleColumns;
+
 JULIA_CPP_MODULE_BEGIN(registry)
   using namespace cxx_wrap;
 
   cxx_wrap::Module& containers = registry.create_module("Containers");
 
   containers.method("test_tuple", []() { return std::make_tuple(1, 2., 3.f); });
+  containers.method("test_mixed_bits_tuple", [](const double x) { return std::make_tuple(true, static_cast<int16_t>(2), x, static_cast<uint8_t>(3)); });
+  containers.method("test_empty_tuple", []() { return std::tuple<>(); });
   containers.method("const_ptr", []() { return ConstPtr<double>({const_vector()}); });
   containers.method("const_ptr_arg", [](ConstPtr<double> p) { return std::make_tuple(p.ptr[0], p.ptr[1], p.ptr[2]); });
   containers.method("const_vector", []() { return cxx_wrap::make_const_array(const_vector(), 3); });
   // Note the column-major order for matrices
   containers.method("const_matrix", []() { return cxx_wrap::make_const_array(const_matrix(), 3, 2); });
 
-  containers.export_symbols("test_tuple", "const_ptr", "const_ptr_arg", "const_vector", "const_matrix");
+  containers.method("const_matrix_element", [](const int64_t i, const int64_t j) { return cxx_wrap::make_const_array(const_matrix(), 3, 2)(i,j); });
+
+  // Arrays of immutables are used in place, as arrays of structs or as one array per field
+  containers.add_immutable<Particle>("Particle", cxx_wrap::FieldList<double,double>("x", "v"));
+  containers.method("Particle", [](const double x, const double v) { return Particle({x, v}); });
+  containers.method("advance!", [](cxx_wrap::ArrayRef<Particle> particles, const double dt)
+  {
+    for(Particle& p : particles)
+    {
+      p.x += p.v*dt;
+    }
+  });
+  containers.method("sum_positions", [](cxx_wrap::ArrayRef<Particle> particles)
+  {
+    const cxx_wrap::ArrayView<double,1> x = particles.field_view(&Particle::x);
+    double result = 0.;
+    for(std::ptrdiff_t i = 0; i != x.extent(0); ++i)
+    {
+      result += x(i);
+    }
+    return result;
+  });
+  containers.method("particle_columns", [](cxx_wrap::ArrayRef<Particle> particles)
+  {
+    return ParticleColumns::from_structs(particles, &Particle::x, &Particle::v);
+  });
+  containers.method("advance_columns!", [](ParticleColumns columns, const double dt)
+  {
+    double* x = columns.column<0>().data();
+    const double* v = columns.column<1>().data();
+    for(std::size_t i = 0; i != columns.size(); ++i)
+    {
+      x[i] += v[i]*dt;
+    }
+  });
+  containers.method("store_columns!", [](cxx_wrap::ArrayRef<Particle> particles, ParticleColumns columns)
+  {
+    columns.to_structs(particles, &Particle::x, &Particle::v);
+  });
+
+  containers.export_symbols("test_tuple", "test_mixed_bits_tuple", "test_empty_tuple", "const_ptr", "const_ptr_arg", "const_vector", "const_matrix", "const_matrix_element", "Particle", "advance!", "sum_positions", "particle_columns", "advance_columns!", "store_columns!");
 JULIA_CPP_MODULE_END
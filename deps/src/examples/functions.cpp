@@ -1,9 +1,13 @@
 #include <cxx_wrap.hpp>
 #include <array.hpp>
+#include <event_queue.hpp>
 #include <functions.hpp>
 
 #include <algorithm>
+#include <chrono>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 // C function for performance comparison
 extern "C" CXX_WRAP_EXPORT double half_c(const double d)
@@ -89,8 +93,13 @@ void init_half_module(cxx_wrap::Module& mod)
   mod.method("half_i", half_template<int>);
   mod.method("half_u", half_template<unsigned int>);
 
-  // Register a lambda
+  // Register a lambda. Without captures, it is called through a trampoline without thunk
   mod.method("half_lambda", [](const double a) {return a*0.5;});
+  mod.vectorized_method("half_vectorized", [](const double a) { return a*0.5; });
+  mod.vectorized_method("scaled_sum_vectorized", [](const double a, const double b) { return 2.*a + b; });
+
+  // Same, but forced through std::function for performance comparison
+  mod.method("half_std_function", std::function<double(const double)>([](const double a) {return a*0.5;}));
 
   // Strict number typing
   mod.method("strict_half", [](const cxx_wrap::StrictlyTypedNumber<double> a) {return a.value*0.5;});
@@ -113,6 +122,23 @@ void init_half_module(cxx_wrap::Module& mod)
     });
   });
 
+  // Looping function calling Julia through a compiled function pointer
+  mod.method("half_loop_typed_jlcall!",
+  [](cxx_wrap::ArrayRef<double> in, cxx_wrap::ArrayRef<double> out)
+  {
+    cxx_wrap::TypedJuliaFunction<double(double)> f("half_julia");
+    std::transform(in.begin(), in.end(), out.begin(), f);
+  });
+
+  // Calling Julia once for the complete arrays, or once per batch
+  mod.method("half_loop_batched!",
+  [](cxx_wrap::ArrayRef<double> in, cxx_wrap::ArrayRef<double> out, const int64_t batch_size)
+  {
+    cxx_wrap::JuliaFunction f("half_julia!");
+    f.set_batch_size(batch_size);
+    f.call_batched(out, in);
+  });
+
   // Looping function calling Julia cfunction
   mod.method("half_loop_cfunc!",
   [](cxx_wrap::ArrayRef<double> in, cxx_wrap::ArrayRef<double> out, double(*f)(const double))
@@ -139,6 +165,20 @@ std::string concatenate_strings(const int n, std::string s, const std::string& s
   return result;
 }
 
+// Deleter for arrays moved to Julia, counting how often Julia released the storage
+struct CountingDeleter
+{
+  static int64_t nb_deleted;
+
+  void operator()(double* p) const
+  {
+    ++nb_deleted;
+    delete[] p;
+  }
+};
+
+int64_t CountingDeleter::nb_deleted = 0;
+
 void init_test_module(cxx_wrap::Module& mod)
 {
   mod.method("concatenate_numbers", &concatenate_numbers);
@@ -156,19 +196,229 @@ void init_test_module(cxx_wrap::Module& mod)
   mod.method("test_short", test_short);
   mod.method("test_protect_from_gc", [](jl_value_t* v) { cxx_wrap::protect_from_gc(v); });
   mod.method("test_unprotect_from_gc", [](jl_value_t* v) { cxx_wrap::unprotect_from_gc(v); });
+  mod.method("test_protect_range_from_gc", [](cxx_wrap::ArrayRef<jl_value_t*> arr) { cxx_wrap::protect_from_gc(arr.begin(), arr.end()); });
+  mod.method("test_unprotect_range_from_gc", [](cxx_wrap::ArrayRef<jl_value_t*> arr) { cxx_wrap::unprotect_from_gc(arr.begin(), arr.end()); });
   mod.method("test_julia_call", [](double a, double b)
   {
     cxx_wrap::JuliaFunction julia_max("max");
     return julia_max(a, b);
   });
+  mod.method("test_typed_julia_function", [](const int64_t n)
+  {
+    cxx_wrap::TypedJuliaFunction<double(double,double)> f("typed_julia_add");
+    double result = 0.;
+    for(int64_t i = 0; i != n; ++i)
+    {
+      result = f(result, 1.);
+    }
+    return std::make_tuple(result, f.is_compiled());
+  });
+  mod.method("test_typed_julia_function_const_ref", [](const int64_t n)
+  {
+    cxx_wrap::TypedJuliaFunction<double(const double&, const double&)> f("typed_julia_add");
+    double result = 0.;
+    for(int64_t i = 0; i != n; ++i)
+    {
+      result = f(result, 1.);
+    }
+    return std::make_tuple(result, f.is_compiled());
+  });
+  mod.method("test_typed_julia_function_fallback", []()
+  {
+    cxx_wrap::TypedJuliaFunction<std::string(std::string)> f("typed_julia_concat");
+    return f("a");
+  });
   mod.method("test_string_array", [](cxx_wrap::ArrayRef<std::string> arr)
   {
     return arr[0] == "first" && arr[1] == "second" && *(arr.begin()) == "first" && *(++arr.begin()) == "second";
   });
+  mod.method("test_string_array_total_length", [](cxx_wrap::ArrayRef<std::string> arr)
+  {
+    const std::vector<std::string> strings = arr.to_vector();
+    int64_t result = 0;
+    for(const std::string& str : strings)
+    {
+      result += str.size();
+    }
+    return result;
+  });
+  mod.method("test_parallel_square!", [](cxx_wrap::ArrayRef<double> arr, const int64_t chunk_size)
+  {
+    cxx_wrap::parallel_for(arr, chunk_size, [](double* begin, double* end)
+    {
+      for(double* d = begin; d != end; ++d)
+      {
+        *d *= *d;
+      }
+    });
+  });
+  mod.method("test_parallel_throw", [](cxx_wrap::ArrayRef<double> arr)
+  {
+    cxx_wrap::parallel_for(arr, 1, [](double* begin, double*)
+    {
+      if(*begin < 0.)
+      {
+        throw std::runtime_error("negative value in parallel_for");
+      }
+    });
+  });
+  mod.async_method("test_async_add", [](const double a, const double b, const int64_t delay_ms)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    return a + b;
+  });
+  mod.async_method("test_async_concat", [](const std::string& a, const std::string& b) { return a + b; });
+  mod.async_method("test_async_throw", []() { throw std::runtime_error("error in async call"); });
+  static cxx_wrap::EventQueue<int64_t> event_queue;
+  static std::vector<std::thread> event_threads;
+  mod.method("test_event_queue", []() { return event_queue.julia_handle(); });
+  // Post events from threads that are not managed by Julia
+  mod.method("test_start_event_threads", [](const int64_t nb_threads, const int64_t nb_events)
+  {
+    for(int64_t t = 0; t != nb_threads; ++t)
+    {
+      event_threads.emplace_back([nb_events]()
+      {
+        for(int64_t i = 1; i <= nb_events; ++i)
+        {
+          event_queue.post(i);
+        }
+      });
+    }
+  });
+  mod.method("test_join_event_threads", []()
+  {
+    for(std::thread& t : event_threads)
+    {
+      t.join();
+    }
+    event_threads.clear();
+  });
+  mod.method("test_close_event_queue", []() { event_queue.close(); });
+  mod.method("test_string_ref_size", [](cxx_wrap::StringRef s) { return static_cast<int64_t>(s.size()); });
+  mod.method("test_string_ref_starts_with", [](cxx_wrap::StringRef s, cxx_wrap::StringRef prefix)
+  {
+    return prefix.size() <= s.size() && cxx_wrap::StringRef(s.data(), prefix.size()) == prefix;
+  });
+  mod.method("test_string_identity", [](const std::string& s) { return s; });
+  mod.method("test_string_refs_total_length", [](cxx_wrap::ArrayRef<cxx_wrap::StringRef> arr)
+  {
+    int64_t result = 0;
+    for(const cxx_wrap::StringRef& s : arr.to_vector())
+    {
+      result += s.size();
+    }
+    return result;
+  });
+  mod.method("test_packed_strings", [](cxx_wrap::ArrayRef<std::string> arr)
+  {
+    const cxx_wrap::PackedStrings packed(arr);
+    return std::make_tuple(static_cast<int64_t>(packed.size()), static_cast<int64_t>(packed.nb_bytes()), packed.to_julia());
+  });
   mod.method("test_append_array!", [](cxx_wrap::ArrayRef<double> arr)
   {
     arr.push_back(3.);
   });
+  mod.method("test_append_range!", [](cxx_wrap::ArrayRef<double> arr)
+  {
+    const std::vector<double> values = {4., 5.};
+    arr.reserve(arr.size() + 3);
+    arr.append(values);
+    arr.append(values.rbegin(), values.rend());
+  });
+  mod.method("test_array_from_vector", []()
+  {
+    return cxx_wrap::Array<double>(std::vector<double>({1., 2., 3.}));
+  });
+  mod.method("test_matrix_element", [](cxx_wrap::ArrayRef<double,2> m, const int64_t i, const int64_t j)
+  {
+    return m(i,j);
+  });
+  mod.method("test_matrix_sum", [](cxx_wrap::ArrayRef<double,2> m)
+  {
+    // The view computes the strides once for the whole loop
+    const cxx_wrap::ArrayView<double,2> v = m.view();
+    double result = 0.;
+    for(std::ptrdiff_t j = 0; j != v.extent(1); ++j)
+    {
+      for(std::ptrdiff_t i = 0; i != v.extent(0); ++i)
+      {
+        result += v(i,j);
+      }
+    }
+    return result;
+  });
+  mod.method("test_matrix_strides", [](cxx_wrap::ArrayRef<double,2> m)
+  {
+    return std::make_tuple(m.extent(0), m.extent(1), m.stride(0), m.stride(1));
+  });
+  mod.method("test_column_sum", [](cxx_wrap::ArrayRef<double,2> m, const int64_t j)
+  {
+    const cxx_wrap::ArrayView<double,1> col = m.column(j);
+    double result = 0.;
+    for(std::ptrdiff_t i = 0; i != col.extent(0); ++i)
+    {
+      result += col(i);
+    }
+    return result;
+  });
+  // Simple in-place stencil on a strided view: replace each interior element with the average of its 4 neighbours
+  mod.method("test_stencil!", [](cxx_wrap::ArrayView<double,2> in, cxx_wrap::ArrayView<double,2> out)
+  {
+    for(std::ptrdiff_t j = 1; j < in.extent(1)-1; ++j)
+    {
+      for(std::ptrdiff_t i = 1; i < in.extent(0)-1; ++i)
+      {
+        out(i,j) = 0.25*(in(i-1,j) + in(i+1,j) + in(i,j-1) + in(i,j+1));
+      }
+    }
+  });
+  mod.method("test_row_sum", [](cxx_wrap::ArrayView<double,2> m, const int64_t i)
+  {
+    const cxx_wrap::ArrayView<double,1> row = m.row(i);
+    double result = 0.;
+    for(std::ptrdiff_t j = 0; j != row.extent(0); ++j)
+    {
+      result += row(j);
+    }
+    return result;
+  });
+  mod.method("test_column_view", [](cxx_wrap::ArrayView<double,2> m, const int64_t j)
+  {
+    return m.column(j);
+  });
+  mod.method("test_move_vector_to_julia", [](const int64_t n)
+  {
+    std::vector<double> result(n);
+    for(int64_t i = 0; i != n; ++i)
+    {
+      result[i] = i;
+    }
+    return cxx_wrap::ArrayRef<double>(std::move(result));
+  });
+  mod.method("test_move_matrix_to_julia", []()
+  {
+    std::unique_ptr<double[]> result(new double[6]);
+    for(int i = 0; i != 6; ++i)
+    {
+      result[i] = i+1;
+    }
+    return cxx_wrap::ArrayRef<double,2>(std::move(result), 2, 3);
+  });
+  mod.method("test_move_counted_to_julia", [](const int64_t n)
+  {
+    std::unique_ptr<double[], CountingDeleter> result(new double[n]);
+    std::fill(result.get(), result.get() + n, 1.);
+    return cxx_wrap::ArrayRef<double>(std::move(result), n);
+  });
+  mod.method("test_nb_deleted_arrays", []() { return CountingDeleter::nb_deleted; });
+  mod.method("test_string_array_from_vector", []()
+  {
+    const std::vector<std::string> strings = {"first", "second"};
+    cxx_wrap::Array<std::string> result(strings.begin(), strings.end());
+    result.append(strings);
+    return result;
+  });
   // Typed callback
   mod.method("test_safe_cfunction", [](cxx_wrap::SafeCFunction f_data)
   {
@@ -190,9 +440,24 @@ void init_test_module(cxx_wrap::Module& mod)
   });
 }
 
+void init_instrumented_module(cxx_wrap::Module& mod)
+{
+  mod.set_instrumented(true);
+  mod.method("instrumented_half", half_function);
+  mod.method("instrumented_check", [](const double d)
+  {
+    if(d < 0.)
+    {
+      throw std::runtime_error("Negative argument");
+    }
+    return d;
+  });
+}
+
 }
 
 JULIA_CPP_MODULE_BEGIN(registry)
   functions::init_half_module(registry.create_module("CppHalfFunctions"));
   functions::init_test_module(registry.create_module("CppTestFunctions"));
+  functions::init_instrumented_module(registry.create_module("CppInstrumentedFunctions"));
 JULIA_CPP_MODULE_END
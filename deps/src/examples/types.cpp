@@ -1,4 +1,5 @@
 #include <string>
+#include <vector>
 
 #include <cxx_wrap.hpp>
 #include <functions.hpp>
@@ -87,6 +88,44 @@ void call_testype_function()
   cxx_wrap::JuliaFunction("julia_test_func")(result);
 }
 
+// Small type that is allocated from a pool
+struct Pooled
+{
+  Pooled(const int v = 0) : m_value(v) { ++nb_alive; }
+  Pooled(const Pooled& other) : m_value(other.m_value) { ++nb_alive; }
+  ~Pooled() { --nb_alive; }
+  int value() const { return m_value; }
+  int m_value;
+  static int nb_alive;
+};
+
+int Pooled::nb_alive = 0;
+
+// Small trivially copyable type that is stored inline in the Julia object
+struct InlinePoint
+{
+  InlinePoint(const double x = 0., const double y = 0.) : m_x(x), m_y(y) {}
+  double x() const { return m_x; }
+  double y() const { return m_y; }
+  void translate(const double dx, const double dy) { m_x += dx; m_y += dy; }
+  double m_x;
+  double m_y;
+};
+
+// Large object counting its copies, to check that it is moved when returned by value or passed as Moved
+struct Buffer
+{
+  Buffer(const int64_t n = 0) : data(n, 1.) {}
+  Buffer(const Buffer& other) : data(other.data) { ++nb_copies; }
+  Buffer(Buffer&&) = default;
+  Buffer& operator=(const Buffer& other) { data = other.data; ++nb_copies; return *this; }
+  Buffer& operator=(Buffer&&) = default;
+  std::vector<double> data;
+  static int nb_copies;
+};
+
+int Buffer::nb_copies = 0;
+
 enum CppEnum
 {
   EnumValA,
@@ -99,6 +138,13 @@ namespace cxx_wrap
 {
   template<> struct IsImmutable<cpp_types::ImmutableDouble> : std::true_type {};
   template<> struct IsBits<cpp_types::CppEnum> : std::true_type {};
+  template<> struct UsePool<cpp_types::Pooled> : std::true_type {};
+  template<> struct IsInline<cpp_types::InlinePoint> : std::true_type {};
+  template<> struct IsWrapped<cpp_types::Buffer> : std::true_type {};
+  template<> struct SizeOf<cpp_types::Buffer>
+  {
+    static std::size_t bytes(const cpp_types::Buffer& b) { return b.data.size()*sizeof(double); }
+  };
 }
 
 JULIA_CPP_MODULE_BEGIN(registry)
@@ -112,7 +158,7 @@ JULIA_CPP_MODULE_BEGIN(registry)
 
   types.add_type<World>("World")
     .constructor<const std::string&>()
-    .method("set", &World::set)
+    .method("set", CXX_WRAP_MEMBER(&World::set))
     .method("greet", &World::greet);
   types.method("world_factory", []()
   {
@@ -154,6 +200,28 @@ JULIA_CPP_MODULE_BEGIN(registry)
     .constructor<const World*>()
     .method("greet", &ConstPtrConstruct::greet);
 
+  types.add_type<Pooled>("Pooled")
+    .constructor<int>()
+    .method("value", &Pooled::value);
+  types.method("pooled_alive", []() { return Pooled::nb_alive; });
+
+  types.add_type<InlinePoint>("InlinePoint")
+    .constructor<double, double>()
+    .method("x", &InlinePoint::x)
+    .method("y", &InlinePoint::y)
+    .method("translate!", &InlinePoint::translate);
+
+  types.add_type<Buffer>("Buffer");
+  types.method("make_buffer", [](const int64_t n) { return Buffer(n); });
+  types.method("copy_buffer", [](const Buffer& b) { return b; });
+  types.method("buffer_size", [](const Buffer& b) { return static_cast<int64_t>(b.data.size()); });
+  types.method("buffer_copies", []() { return Buffer::nb_copies; });
+  types.method("consume_buffer", [](cxx_wrap::Moved<Buffer> b)
+  {
+    const Buffer taken = b.take();
+    return static_cast<int64_t>(taken.data.size());
+  });
+
   // Enum
   types.add_bits<CppEnum>("CppEnum");
   types.set_const("EnumValA", EnumValA);
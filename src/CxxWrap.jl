@@ -53,6 +53,60 @@ immutable ConstArray{T,N} <: CppArray{T,N}
   size::NTuple{N,Int}
 end
 
+# Copy all elements of a ConstArray using a single memory copy
+function Base.copy!{T}(dest::Array{T}, src::ConstArray{T})
+  if length(dest) < length(src)
+    throw(BoundsError(dest, length(src)))
+  end
+  unsafe_copy!(pointer(dest), src.ptr.ptr, length(src))
+  return dest
+end
+
+Base.copy{T,N}(src::ConstArray{T,N}) = copy!(Array{T,N}(src.size), src)
+
+# Array sharing the memory of a ConstArray. It must not be modified and is only valid as long as the C++ data exists.
+@static if VERSION >= v"0.5-dev"
+  Base.unsafe_wrap{T,N}(::Type{Array}, arr::ConstArray{T,N}) = unsafe_wrap(Array, arr.ptr.ptr, arr.size)
+end
+
+# Argument passed to a C++ function taking a cxx_wrap::Moved{T}, which may take over the contents of the object instead of copying them
+immutable Moved{T<:CppAny}
+  value::T
+end
+
+# Strided view on the data of an array, corresponding to cxx_wrap::ArrayView
+immutable StridedView{T,N} <: CppBits
+  ptr::Ptr{T}
+  size::NTuple{N,Int}
+  strides::NTuple{N,Int}
+end
+
+StridedView{T,N}(a::StridedArray{T,N}) = StridedView{T,N}(pointer(a), size(a), strides(a))
+Base.convert{T,N}(::Type{StridedView{T,N}}, a::StridedArray{T,N}) = StridedView(a)
+
+# Arrays passed for a StridedView argument are converted inside ccall, which keeps the array alive during the call
+Base.cconvert{T,N}(::Type{StridedView{T,N}}, a::StridedArray{T,N}) = a
+Base.unsafe_convert{T,N}(::Type{StridedView{T,N}}, a::StridedArray{T,N}) = StridedView(a)
+
+# Statistics for the allocation pool of a C++ type marked with UsePool
+immutable PoolStats
+  capacity::Int64
+  live::Int64
+  pending::Int64
+  slabs::Int64
+  batches::Int64
+end
+
+# Call statistics for a function of an instrumented C++ module. histogram[i+1] counts the calls taking from 2^i up to 2^(i+1) ns.
+type FunctionStats
+  module_name::AbstractString
+  name::Any
+  calls::Int64
+  time_ns::Int64
+  exceptions::Int64
+  histogram::Array{Int64,1}
+end
+
 # Encapsulate information about a function
 type CppFunctionInfo
   name::Any
@@ -62,6 +116,20 @@ type CppFunctionInfo
   thunk_pointer::Ptr{Void}
 end
 
+# Function pointers used by the generated wrappers of a module. Generated code looks up its pointers here, so previously generated
+# definitions (e.g. from precompilation) are reused by rebinding the pointers. ranges maps a library cache key to its entries.
+# lazy holds the functions that are only wrapped when first called, with the index of their pointers.
+type WrapperCache
+  pointers::Array{Ptr{Void},1}
+  ranges::Dict{UInt,UnitRange{Int}}
+  lazy::Dict{Symbol,Array{Tuple{CppFunctionInfo,Int},1}}
+end
+
+WrapperCache() = WrapperCache(Ptr{Void}[], Dict{UInt,UnitRange{Int}}(), Dict{Symbol,Array{Tuple{CppFunctionInfo,Int},1}}())
+
+# Increase when the generated wrapper code changes, to invalidate cached definitions
+const wrapper_cache_version = 1
+
 function __init__()
   @static if is_windows()
     Libdl.dlopen(cxx_wrap_path, Libdl.RTLD_GLOBAL)
@@ -96,6 +164,17 @@ function exported_symbols(registry::Ptr{Void}, modname::AbstractString)
   ccall((:get_exported_symbols, cxx_wrap_path), Array{AbstractString}, (Ptr{Void},AbstractString), registry, modname)
 end
 
+function vectorized_functions(registry::Ptr{Void}, modname::AbstractString)
+  ccall((:get_vectorized_functions, cxx_wrap_path), Array{AbstractString}, (Ptr{Void},AbstractString), registry, modname)
+end
+
+function has_types(registry::Ptr{Void}, modname::AbstractString)
+  ccall((:module_has_types, cxx_wrap_path), Bool, (Ptr{Void},AbstractString), registry, modname)
+end
+
+# True while precompiling a module, which is when generated wrappers may need their pointers rebound later
+precompiling() = ccall(:jl_generating_output, Cint, ()) == 1
+
 # Interpreted as a constructor for Julia  > 0.5
 type ConstructorFname
   _type::DataType
@@ -160,24 +239,25 @@ function argument_overloads(t::Type{Array{AbstractString,1}})
   end
 end
 
-# Build the expression to wrap the given function
-function build_function_expression(func::CppFunctionInfo)
+# Build the expression to wrap the given function. If pointers is nothing, the function pointer and thunk are constants in the generated code.
+# Otherwise they are read from pointers[idx] and pointers[idx+1] at call time, so they can be rebound.
+function build_function_expression(func::CppFunctionInfo, pointers=nothing, idx::Int=0)
   # Arguments and types
   argtypes = func.argument_types
   argsymbols = map((i) -> Symbol(:arg,i[1]), enumerate(argtypes))
 
   # Function pointer
-  fpointer = func.function_pointer
-  assert(fpointer != C_NULL)
+  assert(func.function_pointer != C_NULL)
+  fpointer = pointers == nothing ? func.function_pointer : :($pointers[$idx])
 
   # Thunk
-  thunk = func.thunk_pointer
+  thunk = pointers == nothing ? func.thunk_pointer : :($pointers[$(idx+1)])
 
   function map_c_arg_type(t::DataType)
     if(t <: CppBits)
       return t
     end
-    if ((t <: CppAny) || (t <: CppDisplay) || (t <: Tuple)) || (t <: CppArray)
+    if ((t <: CppAny) || (t <: CppDisplay) || (t <: Tuple)) || (t <: CppArray) || (t <: Moved)
       return Any
     end
 
@@ -189,8 +269,9 @@ function build_function_expression(func::CppFunctionInfo)
   end
   map_c_arg_type{T}(a::Type{StrictlyTypedNumber{T}}) = T
 
-  map_julia_arg_type(t::DataType) = t
+  map_julia_arg_type(t) = t
   map_julia_arg_type{T}(a::Type{StrictlyTypedNumber{T}}) = T
+  map_julia_arg_type{T,N}(a::Type{StridedView{T,N}}) = Union{StridedView{T,N}, StridedArray{T,N}}
 
   # Build the types for the ccall argument list
   c_arg_types = [map_c_arg_type(t) for t in argtypes]
@@ -198,30 +279,13 @@ function build_function_expression(func::CppFunctionInfo)
 
   # Build the final call expression
   call_exp = nothing
-  if thunk == C_NULL
+  if func.thunk_pointer == C_NULL
     call_exp = :(ccall($fpointer, $return_type, ($(c_arg_types...),), $(argsymbols...))) # Direct pointer call
   else
     call_exp = :(ccall($fpointer, $return_type, (Ptr{Void}, $(c_arg_types...)), $thunk, $(argsymbols...))) # use thunk (= std::function)
   end
   assert(call_exp != nothing)
 
-  nargs = length(argtypes)
-
-  function recurse_overloads!(idx::Int, newargs, results)
-    if idx > nargs
-        push!(results, deepcopy(newargs))
-        return
-    end
-    for i in 1:(length(argument_overloads(argtypes[idx]))+1)
-        newargs[idx] = i == 1 ? argtypes[idx] : argument_overloads(argtypes[idx])[i-1]
-        recurse_overloads!(idx+1, newargs, results)
-    end
-  end
-
-  newargs = Array{DataType,1}(nargs);
-  overload_sigs = Array{Array{DataType,1},1}();
-  recurse_overloads!(1, newargs, overload_sigs);
-
   # Build an array of arg1::Type1... expressions
   function argmap(signature)
     result = Expr[]
@@ -232,14 +296,91 @@ function build_function_expression(func::CppFunctionInfo)
   end
 
   function_expressions = [:($(make_func_declaration(func.name, argmap(argtypes))) = $call_exp)]
-  for signature in overload_sigs[2:end] # the first "overload" is the same as the base signature, so skip it
+
+  # A single method accepts the overloads of all arguments at once, using a Union per argument, and converts them for the base method.
+  # Calls with the exact argument types still go to the base method, since it is more specific.
+  overload_types = [argument_overloads(t) for t in argtypes]
+  if any(o -> !isempty(o), overload_types)
+    signature = [isempty(o) ? t : Union{t, o...} for (t, o) in zip(argtypes, overload_types)]
     push!(function_expressions, :($(make_func_declaration(func.name, argmap(signature))) = $(make_overloaded_call(func.name, argtypes, argsymbols))))
   end
   return function_expressions
 end
 
-# Wrap functions from the cpp module to the passed julia module
-function wrap_functions(functions, julia_mod)
+# Broadcast methods for the array overload name(out, in...) of a function added with vectorized_method in C++
+function build_broadcast_expressions(func::CppFunctionInfo)
+  name = func.name
+  out_type = func.argument_types[1]
+  argsymbols = map((i) -> Symbol(:arg,i), 1:length(func.argument_types)-1)
+  typed_args = [:($s::$t) for (s,t) in zip(argsymbols, func.argument_types[2:end])]
+  return [
+    :(Base.broadcast(::typeof($name), $(typed_args...)) = (out = $out_type(length(arg1)); $name(out, $(argsymbols...)); out)),
+    :(Base.broadcast!(::typeof($name), out::$out_type, $(typed_args...)) = ($name(out, $(argsymbols...)); out))
+  ]
+end
+
+# Get the wrapper cache of a module, creating it if needed
+function wrapper_cache(julia_mod::Module)
+  if !isdefined(julia_mod, :__cxxwrap_cache)
+    Core.eval(julia_mod, :(const __cxxwrap_cache = $(WrapperCache())))
+  end
+  return getfield(julia_mod, :__cxxwrap_cache)
+end
+
+# Key identifying the wrappers generated for a library, or 0 if they can't be cached. Based on the file metadata, so the library is not read.
+function wrapper_cache_key(so_path::AbstractString)
+  if !isfile(so_path)
+    return UInt(0)
+  end
+  st = stat(so_path)
+  return hash((wrapper_cache_version, abspath(so_path), st.size, st.mtime))
+end
+
+# Generate the methods of a lazily wrapped function and call it
+function call_lazy(julia_mod::Module, name::Symbol, args...)
+  cache = wrapper_cache(julia_mod)
+  if !haskey(cache.lazy, name)
+    throw(MethodError(getfield(julia_mod, name), args))
+  end
+  for (func, idx) in pop!(cache.lazy, name)
+    pointers_exp = idx == 0 ? nothing : :($julia_mod.__cxxwrap_cache.pointers)
+    for f in build_function_expression(func, pointers_exp, idx)
+      Core.eval(julia_mod, f)
+    end
+  end
+  @static if isdefined(Base, :invokelatest)
+    return Base.invokelatest(getfield(julia_mod, name), args...)
+  else
+    return getfield(julia_mod, name)(args...)
+  end
+end
+
+# Wrap functions from the cpp module to the passed julia module. If the definitions for cache_key already exist, only the pointers are updated.
+# With rebindable set and a nonzero cache_key, the new definitions read their pointers from the module cache so they can be reused,
+# otherwise the pointers are constants in the generated code. Modules with types must pass a zero cache_key.
+# With lazy set, functions with a plain name get a stub that generates the real methods on the first call.
+# Broadcasting the functions named in vectorized calls their array overload.
+function wrap_functions(functions, julia_mod, cache_key::UInt=UInt(0); lazy::Bool=false, vectorized=AbstractString[], rebindable::Bool=precompiling())
+  cache = wrapper_cache(julia_mod)
+  new_pointers = Ptr{Void}[]
+  for func in functions
+    push!(new_pointers, func.function_pointer, func.thunk_pointer)
+  end
+
+  if cache_key != 0 && haskey(cache.ranges, cache_key) && length(cache.ranges[cache_key]) == length(new_pointers)
+    cache.pointers[cache.ranges[cache_key]] = new_pointers
+    return
+  end
+
+  pointers_exp = nothing
+  first_idx = 0
+  if cache_key != 0 && rebindable
+    first_idx = length(cache.pointers) + 1
+    append!(cache.pointers, new_pointers)
+    cache.ranges[cache_key] = first_idx:length(cache.pointers)
+    pointers_exp = :($julia_mod.__cxxwrap_cache.pointers)
+  end
+
   basenames = Set([
     :getindex,
     :setindex!,
@@ -250,21 +391,39 @@ function wrap_functions(functions, julia_mod)
     :*,
     :(==)
   ])
-  for func in functions
-    if in(func.name, basenames)
-      for f in build_function_expression(func)
+  for (i, func) in enumerate(functions)
+    idx = pointers_exp == nothing ? 0 : first_idx + 2*(i-1)
+    if lazy && isa(func.name, Symbol) && !in(func.name, basenames)
+      if !haskey(cache.lazy, func.name)
+        cache.lazy[func.name] = Tuple{CppFunctionInfo,Int}[]
+        Core.eval(julia_mod, :($(func.name)(args...) = CxxWrap.call_lazy($julia_mod, $(QuoteNode(func.name)), args...)))
+      end
+      push!(cache.lazy[func.name], (func, idx))
+    elseif in(func.name, basenames)
+      for f in build_function_expression(func, pointers_exp, idx)
         Core.eval(Base, f)
       end
     else
-      for f in build_function_expression(func)
+      for f in build_function_expression(func, pointers_exp, idx)
         Core.eval(julia_mod, f)
       end
     end
   end
+
+  @static if VERSION >= v"0.5-dev"
+    vectorized_names = Set([Symbol(s) for s in vectorized])
+    for func in functions
+      if in(func.name, vectorized_names) && !isempty(func.argument_types) && func.argument_types[1] <: Array
+        for f in build_broadcast_expressions(func)
+          Core.eval(julia_mod, f)
+        end
+      end
+    end
+  end
 end
 
 # Create modules defined in the given library, wrapping all their functions and types
-function wrap_modules(registry::Ptr{Void}, parent_mod=Main)
+function wrap_modules(registry::Ptr{Void}, parent_mod=Main, cache_key::UInt=UInt(0); lazy::Bool=false, rebindable::Bool=precompiling())
   module_names = get_module_names(registry)
   jl_modules = Module[]
   for mod_name in module_names
@@ -279,8 +438,9 @@ function wrap_modules(registry::Ptr{Void}, parent_mod=Main)
   end
 
   module_functions = get_module_functions(registry)
-  for (jl_mod, mod_functions) in zip(jl_modules, module_functions)
-    wrap_functions(mod_functions, jl_mod)
+  for (jl_mod, mod_functions, mod_name) in zip(jl_modules, module_functions, module_names)
+    mod_key = has_types(registry, mod_name) ? UInt(0) : cache_key
+    wrap_functions(mod_functions, jl_mod, mod_key, lazy=lazy, vectorized=vectorized_functions(registry, mod_name), rebindable=rebindable)
   end
 
   for (jl_mod, mod_name) in zip(jl_modules, module_names)
@@ -290,13 +450,14 @@ function wrap_modules(registry::Ptr{Void}, parent_mod=Main)
 end
 
 # Wrap modules in the given path
-function wrap_modules(so_path::AbstractString, parent_mod=Main)
-  registry = CxxWrap.load_modules(lib_path(so_path))
-  wrap_modules(registry, parent_mod)
+function wrap_modules(so_path::AbstractString, parent_mod=Main; lazy::Bool=false, rebindable::Bool=precompiling())
+  path = lib_path(so_path)
+  registry = CxxWrap.load_modules(path)
+  wrap_modules(registry, parent_mod, wrapper_cache_key(Libdl.dlpath(path)), lazy=lazy, rebindable=rebindable)
 end
 
 # Place the functions and types into the current module
-function wrap_module(registry, parent_mod=Main)
+function wrap_module(registry, parent_mod=Main, cache_key::UInt=UInt(0); lazy::Bool=false, rebindable::Bool=precompiling())
   module_names = get_module_names(registry)
   mod_idx = 0
   wanted_name = string(module_name(current_module()))
@@ -313,17 +474,128 @@ function wrap_module(registry, parent_mod=Main)
   end
 
   module_functions = get_module_functions(registry)
-  wrap_functions(module_functions[mod_idx], current_module())
+  mod_key = has_types(registry, wanted_name) ? UInt(0) : cache_key
+  wrap_functions(module_functions[mod_idx], current_module(), mod_key, lazy=lazy, vectorized=vectorized_functions(registry, wanted_name), rebindable=rebindable)
 
   exps = [Symbol(s) for s in exported_symbols(registry, wanted_name)]
   Core.eval(current_module(), :(export $(exps...)))
 end
 
-function wrap_module(so_path::AbstractString, parent_mod=Main)
-  registry = CxxWrap.load_modules(lib_path(so_path))
-  wrap_module(registry, parent_mod)
+function wrap_module(so_path::AbstractString, parent_mod=Main; lazy::Bool=false, rebindable::Bool=precompiling())
+  path = lib_path(so_path)
+  registry = CxxWrap.load_modules(path)
+  wrap_module(registry, parent_mod, wrapper_cache_key(Libdl.dlpath(path)), lazy=lazy, rebindable=rebindable)
+end
+
+# Owner of the C++ objects created using cxx_wrap::create by the task that opened it, while it is open
+type Arena
+  cpp_arena::Ptr{Void}
+
+  function Arena()
+    result = new(ccall((:open_arena, cxx_wrap_path), Ptr{Void}, ()))
+    push!(open_arenas(), result)
+    finalizer(result, release_arena)
+    return result
+  end
+end
+
+# Arenas opened by the current task and not closed yet. This keeps them reachable, so an arena is never finalized while it can still adopt objects.
+open_arenas() = get!(() -> Arena[], task_local_storage(), :cxxwrap_open_arenas)::Vector{Arena}
+
+# Delete all objects owned by the arena
+function Base.close(arena::Arena)
+  if arena.cpp_arena != C_NULL
+    filter!(a -> a !== arena, open_arenas())
+    ccall((:close_arena, cxx_wrap_path), Void, (Ptr{Void},), arena.cpp_arena)
+    arena.cpp_arena = C_NULL
+  end
 end
 
+# Finalizer, only reached for an open arena once its task is gone. The objects may still be referenced, so they are left to the garbage collector.
+function release_arena(arena::Arena)
+  if arena.cpp_arena != C_NULL
+    ccall((:release_arena, cxx_wrap_path), Void, (Ptr{Void},), arena.cpp_arena)
+    arena.cpp_arena = C_NULL
+  end
+end
+
+Base.length(arena::Arena) = arena.cpp_arena == C_NULL ? 0 : Int(ccall((:arena_size, cxx_wrap_path), Csize_t, (Ptr{Void},), arena.cpp_arena))
+
+# Call f(arena) with a new arena that owns the C++ objects created during the call and deletes them afterwards
+function with_arena(f::Function)
+  arena = Arena()
+  try
+    return f(arena)
+  finally
+    close(arena)
+  end
+end
+
+# Statistics for all functions of instrumented modules, see Module::set_instrumented in C++
+function_stats() = ccall((:get_function_stats, cxx_wrap_path), Array{FunctionStats,1}, ())
+
+# Set the call statistics of all instrumented functions to zero
+reset_function_stats() = ccall((:clear_function_stats, cxx_wrap_path), Void, ())
+
+# Start or stop recording trace events for calls to instrumented functions, JuliaFunction calls and finalizers
+enable_tracing(enabled::Bool=true) = ccall((:enable_tracing, cxx_wrap_path), Void, (Bool,), enabled)
+
+# The recorded trace events, as a JSON string in the Chrome trace event format
+trace_events() = ccall((:get_trace, cxx_wrap_path), Any, ())
+
+# Write the trace events to a file that can be loaded in chrome://tracing or Perfetto
+write_trace(filename::AbstractString) = open(io -> write(io, trace_events()), filename, "w")
+
+clear_trace() = ccall((:clear_trace_events, cxx_wrap_path), Void, ())
+
+# Called from C++ by functions added using async_method: the call runs on the C++ thread pool and the returned task
+# waits for it without blocking other tasks. The call is started from the task, so the signal can't arrive before wait.
+# The condition is only closed after the signal, since the C++ thread still uses its handle until then.
+function _async_call(call::Ptr{Void})
+  return @schedule begin
+    cond = Base.AsyncCondition()
+    ccall((:start_async_call, cxx_wrap_path), Void, (Ptr{Void}, Ptr{Void}), call, cond.handle)
+    wait(cond)
+    close(cond)
+    ccall((:finish_async_call, cxx_wrap_path), Any, (Ptr{Void},), call)
+  end
+end
+
+# Call f with an array of events for each batch posted to a C++ EventQueue, whose julia_handle() is passed as queue.
+# The returned task ends when the queue is closed from C++. The readiness check and wait don't yield in between,
+# so a wake-up that arrived while f was running is not lost.
+function drain_events(f::Function, queue::Ptr{Void})
+  return @schedule begin
+    cond = Base.AsyncCondition()
+    ccall((:attach_event_queue, cxx_wrap_path), Void, (Ptr{Void}, Ptr{Void}), queue, cond.handle)
+    while true
+      if !ccall((:event_queue_ready, cxx_wrap_path), Bool, (Ptr{Void},), queue)
+        wait(cond)
+      end
+      batch = ccall((:take_event_batch, cxx_wrap_path), Any, (Ptr{Void},), queue)
+      if batch === nothing
+        break
+      end
+      isempty(batch) || f(batch)
+    end
+    ccall((:attach_event_queue, cxx_wrap_path), Void, (Ptr{Void}, Ptr{Void}), queue, C_NULL)
+    close(cond)
+  end
+end
+
+# Number of threads used by parallel_for in C++, including the calling thread
+thread_pool_size() = Int(ccall((:get_thread_pool_size, cxx_wrap_path), Csize_t, ()))
+
+# Set the number of threads used by parallel_for in C++. 0 restores the default, which is JULIA_NUM_THREADS or the number of cores.
+set_thread_pool_size(n::Integer) = ccall((:resize_thread_pool, cxx_wrap_path), Void, (Csize_t,), n)
+
+# Memory owned by live wrapped C++ objects, as reported by cxx_wrap::SizeOf, in bytes
+external_memory() = Int(ccall((:get_external_memory, cxx_wrap_path), Csize_t, ()))
+
+# Run a garbage collection once at least n bytes, or the live bytes after the last collection if more, were reported by cxx_wrap::SizeOf for new objects.
+# 0 restores the default of 64 MiB.
+set_external_gc_interval(n::Integer) = ccall((:change_external_gc_interval, cxx_wrap_path), Void, (Csize_t,), n)
+
 immutable SafeCFunction
   fptr::Ptr{Void}
   return_type::DataType
@@ -332,6 +604,6 @@ end
 
 safe_cfunction(f::Function, rt::DataType, args::Tuple) = SafeCFunction(cfunction(f, rt, args), rt, [t for t in args])
 
-export wrap_modules, wrap_module, safe_cfunction, load_modules
+export wrap_modules, wrap_module, safe_cfunction, load_modules, with_arena
 
 end # module
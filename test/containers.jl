@@ -5,6 +5,8 @@ wrap_modules(CxxWrap._l_containers)
 using Containers
 
 @test test_tuple() == (1,2.0,3.0f0)
+@test test_mixed_bits_tuple(1.5) == (true, Int16(2), 1.5, UInt8(3))
+@test test_empty_tuple() == ()
 
 cptr = const_ptr()
 @test isbits(typeof(cptr))
@@ -17,6 +19,36 @@ cv = const_vector()
 cm = const_matrix()
 @test size(cm) == (3,2)
 @test cm == [[1.,2.,3.] [4.,5.,6.]]
+@test const_matrix_element(2, 1) == 6.
+
+# Bulk access
+@test copy(cm) == [[1.,2.,3.] [4.,5.,6.]]
+cm_dest = zeros(3,2)
+copy!(cm_dest, cm)
+@test cm_dest == [[1.,2.,3.] [4.,5.,6.]]
+@test_throws BoundsError copy!(zeros(5), cm)
+if VERSION >= v"0.5-dev"
+  cm_wrapped = unsafe_wrap(Array, cm)
+  @test size(cm_wrapped) == (3,2)
+  @test cm_wrapped[3,2] == 6.
+end
+# Arrays of immutables
+particles = [Particle(Float64(i), 2.) for i in 1:10]
+@test isbits(Particle)
+advance!(particles, 0.5)
+@test [p.x for p in particles] == collect(2.:11.)
+@test sum_positions(particles) == sum(2.:11.)
+@test sum_positions(Particle[]) == 0.
+(xs, vs) = particle_columns(particles)
+@test xs == collect(2.:11.)
+@test vs == fill(2., 10)
+advance_columns!((xs, vs), 1.)
+@test xs == collect(4.:13.)
+store_columns!(particles, (xs, vs))
+@test particles[1] == Particle(4., 2.)
+@test_throws ErrorException advance_columns!((xs, zeros(2)), 1.)
+@test_throws ErrorException store_columns!(particles[1:2], (xs, vs))
+
 println("Displaying const matrix")
 display(cm)
 println("")
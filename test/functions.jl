@@ -13,7 +13,28 @@ end
 const functions_lib_path = CxxWrap._l_functions
 
 # Wrap the functions defined in C++
-wrap_modules(functions_lib_path)
+functions_registry = CxxWrap.load_modules(functions_lib_path)
+wrap_modules(functions_registry)
+
+# Outside precompilation the pointers are constants in the generated code
+@test isempty(CppHalfFunctions.__cxxwrap_cache.pointers)
+
+# Rebindable wrappers read their pointers from the module, so wrapping the same library again only updates them
+wrap_modules(functions_lib_path, rebindable=true)
+nb_wrapper_pointers = length(CppHalfFunctions.__cxxwrap_cache.pointers)
+@test nb_wrapper_pointers > 0
+wrap_modules(functions_lib_path, rebindable=true)
+@test length(CppHalfFunctions.__cxxwrap_cache.pointers) == nb_wrapper_pointers
+@test CppHalfFunctions.half_d(3) == 1.5
+
+# Lazy wrapping generates the methods on the first call
+module LazyFunctions end
+wrap_modules(functions_lib_path, LazyFunctions, lazy=true)
+@test haskey(LazyFunctions.CppHalfFunctions.__cxxwrap_cache.lazy, :half_d)
+@test LazyFunctions.CppHalfFunctions.half_d(3) == 1.5
+@test !haskey(LazyFunctions.CppHalfFunctions.__cxxwrap_cache.lazy, :half_d)
+@test LazyFunctions.CppHalfFunctions.half_d(3.) == 1.5
+@test_throws MethodError LazyFunctions.CppHalfFunctions.half_d("a")
 
 # Test functions from the CppHalfFunctions module
 @test CppHalfFunctions.half_d(3) == 1.5
@@ -21,12 +42,20 @@ wrap_modules(functions_lib_path)
 @test CppHalfFunctions.half_i(-2) == -1
 @test CppHalfFunctions.half_u(3) == 1
 @test CppHalfFunctions.half_lambda(2.) == 1.
+@test CppHalfFunctions.half_std_function(2.) == 1.
 @test CppHalfFunctions.strict_half(3.) == 1.5
 @test_throws MethodError CppHalfFunctions.strict_half(3)
 
+# Capture-less lambdas are called without a thunk
+half_functions_idx = findfirst(CxxWrap.get_module_names(functions_registry), "CppHalfFunctions")
+half_thunks = Dict([(f.name, f.thunk_pointer) for f in CxxWrap.get_module_functions(functions_registry)[half_functions_idx]])
+@test half_thunks[:half_lambda] == C_NULL
+@test half_thunks[:half_std_function] != C_NULL
+
 # Test functions from the CppTestFunctions module
 @test CppTestFunctions.concatenate_numbers(4, 2.) == "42"
-@test length(methods(CppTestFunctions.concatenate_numbers)) == (Sys.WORD_SIZE == 64 ? 4 : 2) # due to overloads
+@test length(methods(CppTestFunctions.concatenate_numbers)) == 2 # base method and a single method for the overloads
+@test CppTestFunctions.concatenate_numbers(Int32(4), 2) == "42"
 @test CppTestFunctions.concatenate_strings(2, "ho", "la") == "holahola"
 @test CppTestFunctions.test_int32_array(Int32[1,2])
 @test CppTestFunctions.test_int64_array(Int64[1,2])
@@ -53,30 +82,191 @@ a = "str1"
 b = "str2"
 c = "str3"
 protect_arr = CxxWrap._gc_protected
-start_len = length(protect_arr)
 CppTestFunctions.test_protect_from_gc(a)
 CppTestFunctions.test_protect_from_gc(b)
-@test length(protect_arr) == start_len + 2
-@test protect_arr[end-1] == a
-@test protect_arr[end] == b
+a_idx = findfirst(x -> x === a, protect_arr)
+b_idx = findfirst(x -> x === b, protect_arr)
+@test a_idx != 0
+@test b_idx != 0
 CppTestFunctions.test_unprotect_from_gc(a)
-@test length(protect_arr) == start_len + 2
-@test protect_arr[end-1] == nothing
-@test protect_arr[end] == b
+@test protect_arr[a_idx] == nothing
+@test protect_arr[b_idx] == b
 CppTestFunctions.test_protect_from_gc(c)
-@test length(protect_arr) == start_len + 2
-@test protect_arr[end-1] == c
-@test protect_arr[end] == b
+@test protect_arr[a_idx] == c
+@test protect_arr[b_idx] == b
+CppTestFunctions.test_unprotect_from_gc(b)
+CppTestFunctions.test_unprotect_from_gc(c)
+@test findfirst(x -> x === b || x === c, protect_arr) == 0
+
+# Bulk GC protection
+bulk_values = Any["bulk$i" for i in 1:1000]
+CppTestFunctions.test_protect_range_from_gc(bulk_values)
+@test all(v -> findfirst(x -> x === v, protect_arr) != 0, bulk_values)
+CppTestFunctions.test_unprotect_range_from_gc(bulk_values)
+@test findfirst(x -> x === bulk_values[1] || x === bulk_values[end], protect_arr) == 0
 @test CppTestFunctions.test_julia_call(1.,2.) == 2
+
+typed_julia_add(x::Float64, y::Float64) = x + y
+typed_julia_concat(s) = s*"b"
+@test CppTestFunctions.test_typed_julia_function(1000) == (1000., true)
+@test CppTestFunctions.test_typed_julia_function_const_ref(1000) == (1000., true)
+@test CppTestFunctions.test_typed_julia_function_fallback() == "ab"
 @test CppTestFunctions.test_string_array(["first", "second"])
+@test CppTestFunctions.test_string_array_total_length(["first", "second"]) == 11
+many_strings = [string(i) for i in 1:100000]
+@test CppTestFunctions.test_string_array_total_length(many_strings) == sum(length, many_strings)
+@test CppTestFunctions.test_string_ref_size("héllo") == sizeof("héllo")
+@test CppTestFunctions.test_string_ref_starts_with("prefixed", "pre")
+@test !CppTestFunctions.test_string_ref_starts_with("pre", "prefixed")
+@test CppTestFunctions.test_string_identity("a\0b") == "a\0b"
+@test CppTestFunctions.test_string_refs_total_length(many_strings) == sum(sizeof, many_strings)
+let (nb_strings, nb_bytes, copied) = CppTestFunctions.test_packed_strings(["first", "", "second"])
+  @test nb_strings == 3
+  @test nb_bytes == 11
+  @test copied == ["first", "", "second"]
+end
+
+# Vectorized functions
+if VERSION >= v"0.5-dev"
+  vx = collect(1.:10.)
+  @test CppTestFunctions.half_vectorized(3.) == 1.5
+  @test CppTestFunctions.half_vectorized.(vx) == vx ./ 2
+  vout = zeros(10)
+  broadcast!(CppTestFunctions.half_vectorized, vout, vx)
+  @test vout == vx ./ 2
+  @test CppTestFunctions.scaled_sum_vectorized.(vx, vx) == 3 .* vx
+  @test_throws ErrorException CppTestFunctions.half_vectorized(zeros(3), zeros(4))
+end
+
+# Shared C++ thread pool
+default_pool_size = CxxWrap.thread_pool_size()
+@test default_pool_size >= 1
+CxxWrap.set_thread_pool_size(4)
+@test CxxWrap.thread_pool_size() == 4
+parr = collect(1.:100000.)
+CppTestFunctions.test_parallel_square!(parr, 1000)
+@test parr == [x^2 for x in 1.:100000.]
+CppTestFunctions.test_parallel_square!(parr, 200000)
+@test parr[3] == 81.
+@test_throws ErrorException CppTestFunctions.test_parallel_throw([1., 2., -1., 3.])
+CxxWrap.set_thread_pool_size(0)
+@test CxxWrap.thread_pool_size() == default_pool_size
+
+# Asynchronous calls
+if VERSION >= v"0.5-dev"
+  async_task = CppTestFunctions.test_async_add(1., 2., 200)
+  @test isa(async_task, Task)
+  nb_yields = 0
+  while !istaskdone(async_task)
+    nb_yields += 1
+    sleep(0.01)
+  end
+  @test nb_yields > 1
+  @test wait(async_task) == 3.
+  @test wait(CppTestFunctions.test_async_concat("a", "b")) == "ab"
+  concurrent_tasks = [CppTestFunctions.test_async_add(Float64(i), 1., 10) for i in 1:20]
+  @test [wait(t) for t in concurrent_tasks] == [Float64(i+1) for i in 1:20]
+  @test_throws ErrorException wait(CppTestFunctions.test_async_throw())
+end
+
+# Events posted from C++ threads
+if VERSION >= v"0.5-dev"
+  received_events = Int64[]
+  nb_event_batches = Ref(0)
+  event_queue = CppTestFunctions.test_event_queue()
+  drainer = CxxWrap.drain_events(event_queue) do events
+    append!(received_events, events)
+    nb_event_batches[] += 1
+  end
+  CppTestFunctions.test_start_event_threads(4, 25000)
+  wait_start = time()
+  while length(received_events) < 100000 && time() - wait_start < 30
+    sleep(0.01)
+  end
+  CppTestFunctions.test_join_event_threads()
+  @test length(received_events) == 100000
+  @test sum(received_events) == 4*sum(1:25000)
+  @test nb_event_batches[] < 100000
+  CppTestFunctions.test_close_event_queue()
+  wait(drainer)
+  @test istaskdone(drainer)
+end
+
 darr = [1.,2.]
 CppTestFunctions.test_append_array!(darr)
 @test darr == [1.,2.,3.]
+CppTestFunctions.test_append_range!(darr)
+@test darr == [1.,2.,3.,4.,5.,5.,4.]
+@test CppTestFunctions.test_array_from_vector() == [1.,2.,3.]
+@test CppTestFunctions.test_string_array_from_vector() == ["first", "second", "first", "second"]
+mat = [1. 2. 3.; 4. 5. 6.]
+@test CppTestFunctions.test_matrix_element(mat, 1, 2) == 6.
+@test CppTestFunctions.test_matrix_sum(mat) == sum(mat)
+@test CppTestFunctions.test_matrix_strides(mat) == (2, 3, 1, 2)
+@test CppTestFunctions.test_column_sum(mat, 1) == 7.
+@test CppTestFunctions.test_row_sum(mat, 1) == 15.
+@test CppTestFunctions.test_row_sum(view(mat, :, 2:3), 0) == 5.
+@test CppTestFunctions.test_row_sum([1. 2.; 3. 4.], 0) == 3.
+col_view = CppTestFunctions.test_column_view(mat, 2)
+@test isa(col_view, CxxWrap.StridedView{Float64,1})
+@test col_view.size == (2,)
+@test unsafe_load(col_view.ptr, 2) == 6.
+stencil_in = reshape(collect(1.:25.), 5, 5)
+stencil_out = zeros(5, 5)
+CppTestFunctions.test_stencil!(stencil_in, stencil_out)
+@test stencil_out[2:4,2:4] == stencil_in[2:4,2:4]
+stencil_out = zeros(3, 3)
+CppTestFunctions.test_stencil!(view(stencil_in, 2:4, 2:4), stencil_out)
+@test stencil_out[2,2] == stencil_in[3,3]
+moved_vec = CppTestFunctions.test_move_vector_to_julia(1000)
+@test length(moved_vec) == 1000
+@test moved_vec[end] == 999.
+@test CppTestFunctions.test_move_matrix_to_julia() == [1. 3. 5.; 2. 4. 6.]
+moved_vec = nothing
+counted_vec = CppTestFunctions.test_move_counted_to_julia(100)
+@test sum(counted_vec) == 100.
+counted_vec = nothing
+gc()
+@test CppTestFunctions.test_nb_deleted_arrays() == 1
 
 testf(x,y) = x+y
 @show c_func = safe_cfunction(testf, Float64, (Float64,Float64))
 CppTestFunctions.test_safe_cfunction(c_func)
 CppTestFunctions.test_safe_cfunction2(c_func)
+# The second conversion uses the cached check, a pointer with another signature must still be checked
+CppTestFunctions.test_safe_cfunction(c_func)
+@test_throws ErrorException CppTestFunctions.test_safe_cfunction(safe_cfunction(testf, Float64, (Float64,Int)))
+
+# Call statistics for instrumented modules
+CxxWrap.reset_function_stats()
+for i in 1:10
+  @test CppInstrumentedFunctions.instrumented_half(2.) == 1.
+end
+@test_throws ErrorException CppInstrumentedFunctions.instrumented_check(-1.)
+@test CppInstrumentedFunctions.instrumented_check(1.) == 1.
+instrumented_stats = Dict([(s.name, s) for s in CxxWrap.function_stats() if s.module_name == "CppInstrumentedFunctions"])
+# The library was loaded several times above, but each function is listed once
+@test count(s -> s.module_name == "CppInstrumentedFunctions" && s.name == :instrumented_half, CxxWrap.function_stats()) == 1
+@test instrumented_stats[:instrumented_half].calls == 10
+@test sum(instrumented_stats[:instrumented_half].histogram) == 10
+@test instrumented_stats[:instrumented_check].calls == 2
+@test instrumented_stats[:instrumented_check].exceptions == 1
+CxxWrap.reset_function_stats()
+@test all(s -> s.calls == 0, CxxWrap.function_stats())
+
+# Trace events
+CxxWrap.clear_trace()
+CxxWrap.enable_tracing()
+CppInstrumentedFunctions.instrumented_half(2.)
+CppTestFunctions.test_julia_call(1.,2.)
+CxxWrap.enable_tracing(false)
+CppInstrumentedFunctions.instrumented_half(2.)
+trace = CxxWrap.trace_events()
+@test contains(trace, "\"name\":\"CppInstrumentedFunctions.instrumented_half\",\"cat\":\"cpp_call\"")
+@test contains(trace, "\"name\":\"max\",\"cat\":\"julia_call\"")
+@test length(matchall(r"instrumented_half", trace)) == 1
+CxxWrap.clear_trace()
+@test !contains(CxxWrap.trace_events(), "cpp_call")
 
 # Performance tests
 const test_size = Sys.ARCH == :armv7l ? 1000000 : 50000000
@@ -99,12 +289,17 @@ end
 
 # Julia version
 half_julia(d::Float64) = d*0.5
+function half_julia!(out, arr)
+  for i in eachindex(out)
+    out[i] = half_julia(arr[i])
+  end
+end
 
 # C version
 half_c(d::Float64) = ccall((:half_c, functions_lib_path), Cdouble, (Cdouble,), d)
 
 # Bring C++ versions into scope
-using CppHalfFunctions.half_d, CppHalfFunctions.half_lambda, CppHalfFunctions.half_loop_cpp!, CppHalfFunctions.half_loop_jlcall!, CppHalfFunctions.half_loop_cfunc!
+using CppHalfFunctions.half_d, CppHalfFunctions.half_lambda, CppHalfFunctions.half_std_function, CppHalfFunctions.half_loop_cpp!, CppHalfFunctions.half_loop_jlcall!, CppHalfFunctions.half_loop_typed_jlcall!, CppHalfFunctions.half_loop_batched!, CppHalfFunctions.half_loop_cfunc!
 
 @static if cxx_available
   # Cxx.jl version
@@ -121,7 +316,8 @@ end
 make_loop_function(:julia)
 make_loop_function(:c)
 make_loop_function(:d) # C++ with regular C++ function pointer
-make_loop_function(:lambda) # C++ lambda, so using std::function
+make_loop_function(:lambda) # C++ lambda without captures, called through a trampoline
+make_loop_function(:std_function) # C++ lambda wrapped in std::function
 if cxx_available
   make_loop_function(:cxxjl) # Cxx.jl version
 end
@@ -137,7 +333,15 @@ test_half_function(half_loop_julia!)
 test_half_function(half_loop_c!)
 test_half_function(half_loop_d!)
 test_half_function(half_loop_lambda!)
+test_half_function(half_loop_std_function!)
 test_half_function(half_loop_cpp!)
+test_half_function(half_loop_typed_jlcall!)
+test_half_function((input, output) -> half_loop_batched!(input, output, 0))
+batched_in = collect(1.:10.)
+batched_out = zeros(10)
+half_loop_batched!(batched_in, batched_out, 3)
+@test batched_out == batched_in ./ 2
+@test_throws ErrorException half_loop_batched!(batched_in, zeros(3), 0)
 if cxx_available
   test_half_function(half_loop_cxxjl!)
 end
@@ -171,6 +375,11 @@ println("C++ lambda test:")
 @time half_loop_lambda!(numbers, output)
 @time half_loop_lambda!(numbers, output)
 
+println("C++ std::function test:")
+@time half_loop_std_function!(numbers, output)
+@time half_loop_std_function!(numbers, output)
+@time half_loop_std_function!(numbers, output)
+
 println("C++ test, loop in the C++ code:")
 @time half_loop_cpp!(numbers, output)
 @time half_loop_cpp!(numbers, output)
@@ -185,6 +394,16 @@ half_cfunc = safe_cfunction(half_julia, Float64, (Float64,))
 const small_in = rand(test_size÷100)
 small_out = zeros(test_size÷100)
 
+println("TypedJuliaFunction inside C++ loop:")
+@time half_loop_typed_jlcall!(numbers, output)
+@time half_loop_typed_jlcall!(numbers, output)
+@time half_loop_typed_jlcall!(numbers, output)
+
+println("Batched Julia call from C++:")
+@time half_loop_batched!(numbers, output, 0)
+@time half_loop_batched!(numbers, output, 0)
+@time half_loop_batched!(numbers, output, 0)
+
 println("jl_call inside C++ loop (array is 100 times smaller than other tests):")
 @time half_loop_jlcall!(small_in, small_out)
 @time half_loop_jlcall!(small_in, small_out)
@@ -107,3 +107,124 @@ CppTypes.call_testype_function()
 @test enum_to_int(CppTypes.EnumValA) == 0
 @test enum_to_int(CppTypes.EnumValB) == 1
 @test get_enum_b() == CppTypes.EnumValB
+
+# Pooled allocation
+pooled = [CppTypes.Pooled(i) for i in 1:1000]
+@test CppTypes.value(pooled[500]) == 500
+stats_before = CppTypes.pool_stats(CppTypes.Pooled)
+@test isa(stats_before, CxxWrap.PoolStats)
+@test stats_before.live >= 1000
+@test stats_before.capacity >= stats_before.live
+pooled = nothing
+gc()
+stats_after = CppTypes.pool_stats(CppTypes.Pooled)
+@test stats_after.live < stats_before.live
+@test stats_after.batches > 0
+# Released objects are destroyed right away, only their slots are recycled in batches
+@test CppTypes.pooled_alive() == stats_after.live
+
+# Inline storage
+p = CppTypes.InlinePoint(1.0, 2.0)
+@test sizeof(CppTypes.InlinePoint) == 2*sizeof(Float64)
+@test CppTypes.x(p) == 1.0
+CppTypes.translate!(p, 0.5, -1.0)
+@test CppTypes.x(p) == 1.5
+@test CppTypes.y(p) == 1.0
+p_copy = deepcopy(p)
+CppTypes.translate!(p, 1.0, 1.0)
+@test CppTypes.x(p_copy) == 1.5
+@test CppTypes.x(p) == 2.5
+
+# Moving objects across the boundary
+buf = CppTypes.make_buffer(1000)
+@test CppTypes.buffer_size(buf) == 1000
+@test CppTypes.buffer_copies() == 0
+buf_copy = CppTypes.copy_buffer(buf)
+@test CppTypes.buffer_copies() == 1
+@test CppTypes.consume_buffer(CxxWrap.Moved(buf)) == 1000
+@test CppTypes.buffer_size(buf) == 0
+@test CppTypes.buffer_size(buf_copy) == 1000
+@test CppTypes.buffer_copies() == 1
+
+# Memory reported to the garbage collector. The moved from buffer still uncounts the size it had when it was created.
+mem_before = CxxWrap.external_memory()
+buf = nothing
+gc()
+@test CxxWrap.external_memory() == mem_before - 8000
+mem_before = CxxWrap.external_memory()
+big_buf = CppTypes.make_buffer(1000000)
+@test CxxWrap.external_memory() == mem_before + 8000000
+big_buf = nothing
+gc()
+@test CxxWrap.external_memory() == mem_before
+CxxWrap.set_external_gc_interval(1 << 20)
+for i in 1:50
+  CppTypes.make_buffer(1000000)
+end
+@test CxxWrap.external_memory() <= mem_before + 16000000
+CxxWrap.set_external_gc_interval(0)
+
+# Arena ownership
+arena_worlds = with_arena() do arena
+  worlds = [World("arena world $i") for i in 1:10]
+  @test length(arena) == 10
+  @test CppTypes.greet(worlds[3]) == "arena world 3"
+  worlds
+end
+@test_throws ErrorException CppTypes.greet(arena_worlds[3])
+
+# Objects created by other tasks while an arena is open are not adopted
+other_task_world = with_arena() do arena
+  w = fetch(@schedule World("other task world"))
+  @test length(arena) == 0
+  w
+end
+@test CppTypes.greet(other_task_world) == "other task world"
+
+# An arena left open by a finished task gives its objects back to the garbage collector
+gc()
+alive_before = CppTypes.pooled_alive()
+wait(@schedule begin
+  CxxWrap.Arena()
+  CppTypes.Pooled(1)
+  global released_pooled = CppTypes.Pooled(2)
+  nothing
+end)
+# The first collection finalizes the arena, the second its unreferenced object
+gc()
+gc()
+@test CppTypes.pooled_alive() == alive_before + 1
+@test CppTypes.value(released_pooled) == 2
+released_pooled = nothing
+gc()
+@test CppTypes.pooled_alive() == alive_before
+
+# Adding roots while the finalizers of released arenas are pending, which remove roots
+for i in 1:20
+  wait(@schedule CxxWrap.Arena())
+end
+many_arenas = [CxxWrap.Arena() for i in 1:2000]
+@test length(CxxWrap.open_arenas()) == 2000
+foreach(close, reverse(many_arenas))
+gc()
+@test isempty(CxxWrap.open_arenas())
+
+# Construction from all threads
+if isdefined(Base, :Threads)
+  nb_threaded = 10000
+  threaded_objects = [Any[] for t in 1:Threads.nthreads()]
+  Threads.@threads for t in 1:Threads.nthreads()
+    objects = threaded_objects[t]
+    for i in 1:nb_threaded
+      push!(objects, CppTypes.Pooled(i))
+      push!(objects, CppTypes.NonCopyable())
+    end
+  end
+  @test all(objects -> length(objects) == 2*nb_threaded, threaded_objects)
+  @test all(objects -> CppTypes.value(objects[end-1]) == nb_threaded, threaded_objects)
+  threaded_stats = CppTypes.pool_stats(CppTypes.Pooled)
+  @test threaded_stats.live >= Threads.nthreads()*nb_threaded
+  threaded_objects = nothing
+  gc()
+  @test CppTypes.pool_stats(CppTypes.Pooled).live < threaded_stats.live
+end